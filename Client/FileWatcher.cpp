@@ -12,9 +12,15 @@ FileWatcher::FileWatcher(boost::asio::ip::tcp::socket sock, std::chrono::duratio
         running_ = false; //It's a fatal error -> start() is automatically blocked and the client ends
         return;
     }
+    loadHashCache();
+    // Watches are added before the creation of the maps so that no change is lost
+    initWatcher();
     // Creation of the maps
+    FileId id;
     for(auto &file : std::filesystem::recursive_directory_iterator(this->path_to_watch)) {
         paths_[file.path().string()] = std::filesystem::last_write_time(file);
+        if(fileId(file.path().string(), id))
+            ids[file.path().string()] = id;
         trace_map[file.path().string()]= {'I', (std::filesystem::is_directory(file.path()) ? FileStatus::dir_created : FileStatus::modified)};
     }
     for(auto & m: trace_map)
@@ -24,96 +30,464 @@ FileWatcher::FileWatcher(boost::asio::ip::tcp::socket sock, std::chrono::duratio
 
 }
 
+/**
+ * Destructor, the inotify instance is closed
+ */
+FileWatcher::~FileWatcher() {
+    if(inotifyFd >= 0)
+        close(inotifyFd);
+}
+
 /**
  * Routine of the file watcher
  */
 void FileWatcher::start() {
-    bool result;
     while(running_) {
-        // Wait for "delay" milliseconds
-        std::this_thread::sleep_for(delay);
+        // Send the uploads in progress for "delay" milliseconds, notified changes are handled meanwhile
+        pump(delay);
         loops++;
 
-        auto it = paths_.begin();
-        while (it != paths_.end()) {
-            if (!std::filesystem::exists(it->first)) {
-                std::cout << "Erased " << it->first <<std::endl;
-                trace_map[it->first]={'I', FileStatus::erased};
-                result=sendMessage(FileStatus::erased,it->first);
-                if(result){
-                    std::cout<<"Server ok!"<<std::endl;
-                    auto del=trace_map.find(it->first);
-                    if(del!=trace_map.end())
-                        trace_map.erase(del);
-                    it = paths_.erase(it);
-                }
-                else
-                    std::cout<<"Server error!"<<std::endl;
-            } else {
-                it++;
+        // Without inotify (or if some events have been lost) the whole tree is scanned
+        if(inotifyFd < 0 || rescan){
+            rescan=false;
+            scan();
+        }
+
+        removeErased();
+
+        // The periodic probe waits for the files being written (for PROBE_MAX_WAIT intervals at most,
+        // files keep changing), the other ones sync them as they are
+        bool periodic = loops>=PROBETIME && (pending.empty() || loops>=PROBETIME*PROBE_MAX_WAIT);
+        if( (sockerr && checkConnection()) || serverr || periodic){
+            if(loops>=PROBETIME)
+                loops=0;
+            // Probe starts when the uploads in progress are done
+            flush();
+            pending.clear();
+            for(auto &m: trace_map)
+                m.second.first='I';
+            probe();
+        }
+    }
+}
+
+/**
+ * Scan the whole watched tree for created, modified and erased entries
+ */
+void FileWatcher::scan() {
+    // The known entries are collected first: checking an entry may drop it from the map (see dropChange())
+    std::vector<std::string> known;
+    known.reserve(paths_.size());
+    for (auto &p : paths_)
+        known.push_back(p.first);
+    for (auto &p : known)
+        checkErased(p);
+
+    // Check if a file was created or modified
+    for (auto &file : std::filesystem::recursive_directory_iterator(path_to_watch)) {
+        if (inotifyFd >= 0 && file.is_directory())
+            addWatch(file.path().string());
+        checkEntry(file.path().string());
+    }
+    flushErased();
+}
+
+/**
+ * Check if an entry was created or modified and send the operation to the server
+ * @param path path of the entry
+ */
+void FileWatcher::checkEntry(const std::string& path) {
+    std::error_code ec;
+    auto current_file_last_write_time = std::filesystem::last_write_time(path, ec);
+    // Entry already erased
+    if (ec)
+        return;
+
+    // File creation (or an entry moved from a path disappeared in the meantime)
+    if (!contains(path)) {
+        if (checkRenamed(path))
+            return;
+        paths_[path] = current_file_last_write_time;
+        FileId id;
+        if (fileId(path, id))
+            ids[path] = id;
+        if (!fs::is_directory(path)) {
+            std::cout << "File created: " << path << " Size: " << fs::file_size(path, ec)<<std::endl;
+            trace_map.insert({path, std::make_pair('I', FileStatus::created)});
+            deferChange(FileStatus::created, path);
+        }
+        else {
+            std::cout << "Directory created: " << path <<std::endl;
+            trace_map.insert({path, std::make_pair('I',FileStatus::dir_created)});
+            sendMessage(FileStatus::dir_created, path);
+        }
+    }
+
+    // File modification
+    else {
+        if(paths_[path] != current_file_last_write_time) {
+            paths_[path] = current_file_last_write_time;
+            if (!fs::is_directory(path)) {
+                std::cout<<"File modified: "<<path<<std::endl;
+                deferChange(FileStatus::modified, path);
             }
         }
+    }
+}
 
-        // Check if a file was created or modified
-        for (auto &file : std::filesystem::recursive_directory_iterator(path_to_watch)) {
-            auto current_file_last_write_time = std::filesystem::last_write_time(file);
+/**
+ * Check if a known entry was erased: it is kept aside until the end of the scan (see flushErased()),
+ * as it may appear again with another path
+ * @param path path of the entry (a copy, the entry may be dropped from the maps)
+ */
+void FileWatcher::checkErased(std::string path) {
+    auto t = trace_map.find(path);
+    // Erase already sent, waiting for its ack
+    if (t != trace_map.end() && t->second.second == FileStatus::erased)
+        return;
+    if (contains(path) && !std::filesystem::exists(path)) {
+        auto id = ids.find(path);
+        if (id != ids.end()) {
+            vanished[id->second] = path;
+            return;
+        }
+        if (dropChange(path))
+            return;
+        std::cout << "Erased " << path <<std::endl;
+        trace_map[path]={'I', FileStatus::erased};
+        sendMessage(FileStatus::erased,path);
+    }
+}
 
-            // File creation
-            if (!contains(file.path().string())) {
-                paths_[file.path().string()] = current_file_last_write_time;
-                if (!fs::is_directory(file.path().string())) {
-                    std::cout << "File created: " << file.path().string() << " Size: " << fs::file_size(file.path().string())<<std::endl;
-                    trace_map.insert({file.path().string(), std::make_pair('I', FileStatus::created)});
+/**
+ * Send the erase of the entries disappeared during the scan that have not been renamed
+ */
+void FileWatcher::flushErased() {
+    std::map<FileId, std::string> erased;
+    erased.swap(vanished);
+    for (auto &v : erased) {
+        auto t = trace_map.find(v.second);
+        if (!contains(v.second) || (t != trace_map.end() && t->second.second == FileStatus::erased))
+            continue;
+        if (dropChange(v.second))
+            continue;
+        std::cout << "Erased " << v.second <<std::endl;
+        trace_map[v.second]={'I', FileStatus::erased};
+        sendMessage(FileStatus::erased,v.second);
+    }
+}
 
-                    result=sendMessage(FileStatus::created,file.path().string());
-                    if(result){
-                        trace_map[file.path().string()].first='V';
-                        std::cout<<"Server ok!"<<std::endl;
-                    }
-                    else
-                        std::cout<<"Server error!"<<std::endl;
+/**
+ * Defer the operation of a changed file until it settles, merging it with the change not yet sent (if any):
+ * a file created and then modified is still new for the server
+ * @param status created or modified
+ * @param path path of the file
+ */
+void FileWatcher::deferChange(FileStatus status, const std::string& path) {
+    auto now = std::chrono::steady_clock::now();
+    auto it = pending.find(path);
+    if (it == pending.end())
+        it = pending.emplace(path, Change{status, -1, -1, now, now}).first;
+    else if (it->second.status == FileStatus::created)
+        status = FileStatus::created;
+    it->second.status = status;
+    it->second.last = now;
+    if (status == FileStatus::modified)
+        trace_map[path] = {'I', status};
+}
 
-                }
-                else {
-                    std::cout << "Directory created: " << file.path().string() <<std::endl;
-                    result=sendMessage(FileStatus::dir_created, file.path().string());
-                    trace_map.insert({file.path().string(), std::make_pair('I',FileStatus::dir_created)});
-                    if(result){
-                        trace_map[file.path().string()].first='V';
-                        std::cout<<"Server ok!"<<std::endl;
-                    }
-                    else
-                        std::cout<<"Server error!"<<std::endl;
-                }
+/**
+ * Drop the change not yet sent of an erased file
+ * @param path path of the file
+ * @return true if the file has never been sent (it is just forgotten), false if the server has to erase it
+ */
+bool FileWatcher::dropChange(const std::string& path) {
+    auto it = pending.find(path);
+    if (it == pending.end())
+        return false;
+    bool created = it->second.status == FileStatus::created;
+    pending.erase(it);
+    if (created) {
+        std::cout << "Erased before being sent: " << path << std::endl;
+        paths_.erase(path);
+        trace_map.erase(path);
+        ids.erase(path);
+    }
+    return created;
+}
+
+/**
+ * Send the changed files that settled: size and last write time unchanged for SETTLE_TIME
+ * (or changing for more than SETTLE_MAX_TIME), so a file being written is sent once, when complete
+ */
+void FileWatcher::settle() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = pending.begin(); it != pending.end() && !sockerr;) {
+        std::error_code ec;
+        std::int64_t size = std::int64_t(fs::file_size(it->first, ec));
+        std::int64_t mtime = ec ? 0 : std::int64_t(fs::last_write_time(it->first, ec).time_since_epoch().count());
+        // Erased meanwhile: the erase is handled by the watcher
+        if (ec) {
+            it++;
+            continue;
+        }
+        if (size != it->second.size || mtime != it->second.mtime) {
+            it->second.size = size;
+            it->second.mtime = mtime;
+            it->second.last = now;
+        }
+        if (now - it->second.last < std::chrono::milliseconds(SETTLE_TIME) &&
+            now - it->second.first < std::chrono::milliseconds(SETTLE_MAX_TIME)) {
+            it++;
+            continue;
+        }
+
+        std::string path = it->first;
+        FileStatus status = it->second.status;
+        it = pending.erase(it);
+        // The changes seen meanwhile are part of this operation
+        auto time = std::filesystem::last_write_time(path, ec);
+        if (!ec)
+            paths_[path] = time;
+        sendMessage(status, path);
+    }
+}
+
+/**
+ * @param deadline end of the current wait
+ * @return time at which the next changed file may settle, if before the deadline
+ */
+std::chrono::steady_clock::time_point FileWatcher::settleDeadline(std::chrono::steady_clock::time_point deadline) {
+    for (auto &p : pending)
+        deadline = std::min({deadline, p.second.last + std::chrono::milliseconds(SETTLE_TIME),
+                             p.second.first + std::chrono::milliseconds(SETTLE_MAX_TIME)});
+    return deadline;
+}
+
+/**
+ * Identity of an entry on the disk
+ * @param path path of the entry
+ * @param id device and inode of the entry
+ * @return true if success, false if the entry doesn't exist
+ */
+bool FileWatcher::fileId(const std::string& path, FileId& id) {
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    id = {std::uint64_t(st.st_dev), std::uint64_t(st.st_ino)};
+    return true;
+}
+
+/**
+ * Check if a new entry is an entry disappeared during the scan (same device and inode) and in that case
+ * send its rename to the server instead of erasing it and sending the new one. Only entries already
+ * synced with the server are renamed (a file with unchanged last write time, a directory whose entries are all synced)
+ * @param path path of the new entry
+ * @return true if the rename has been sent
+ */
+bool FileWatcher::checkRenamed(const std::string& path) {
+    FileId id;
+    if (vanished.empty() || !fileId(path, id))
+        return false;
+    auto v = vanished.find(id);
+    if (v == vanished.end())
+        return false;
+    std::string from = v->second;
+
+    auto t = trace_map.find(from);
+    if (t == trace_map.end() || t->second.first != 'V')
+        return false;
+    bool dir = t->second.second == FileStatus::dir_created;
+    std::error_code ec;
+    if (dir != fs::is_directory(path, ec))
+        return false;
+    if (dir) {
+        for (auto &m : trace_map)
+            if (m.second.first != 'V' && m.first.compare(0, from.size() + 1, from + "/") == 0)
+                return false;
+    } else if (paths_[from] != std::filesystem::last_write_time(path, ec)) {
+        // Inode reused by another file
+        return false;
+    }
+
+    vanished.erase(v);
+    // The entries of a renamed directory are not erased
+    if (dir) {
+        for (auto it = vanished.begin(); it != vanished.end();) {
+            if (it->second.compare(0, from.size() + 1, from + "/") == 0)
+                it = vanished.erase(it);
+            else
+                it++;
+        }
+    }
+
+    std::cout << "Renamed " << from << " to " << path << std::endl;
+    renameEntries(from, path);
+    trace_map[path].first = 'I';
+    sendMessage(FileStatus::renamed, path, 0, from);
+    return true;
+}
+
+/**
+ * Move the entries of the maps from a path to another (with the entries inside, for a directory)
+ * @param from old path
+ * @param to new path
+ */
+void FileWatcher::renameEntries(const std::string& from, const std::string& to) {
+    auto newPath = [&](const std::string& p) -> std::string {
+        if (p == from)
+            return to;
+        if (p.compare(0, from.size() + 1, from + "/") == 0)
+            return to + p.substr(from.size());
+        return "";
+    };
+
+    std::vector<std::string> moved;
+    for (auto &p : paths_)
+        if (!newPath(p.first).empty())
+            moved.push_back(p.first);
+    for (auto &p : moved) {
+        std::string n = newPath(p);
+        paths_[n] = paths_[p];
+        paths_.erase(p);
+        auto t = trace_map.find(p);
+        if (t != trace_map.end()) {
+            trace_map[n] = t->second;
+            trace_map.erase(p);
+        }
+        auto i = ids.find(p);
+        if (i != ids.end()) {
+            ids[n] = i->second;
+            ids.erase(p);
+        }
+    }
+    for (auto &w : watches) {
+        std::string n = newPath(w.second);
+        if (!n.empty())
+            w.second = n;
+    }
+}
+
+/**
+ * Create the inotify instance and watch the whole tree (changes are detected by polling on errors)
+ */
+void FileWatcher::initWatcher() {
+#ifdef __linux__
+    if (!INOTIFY_WATCHER)
+        return;
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0) {
+        std::cout << "inotify not available, changes are detected by polling: " << strerror(errno) << std::endl;
+        return;
+    }
+    addWatch(path_to_watch);
+    std::error_code ec;
+    for (auto &file : std::filesystem::recursive_directory_iterator(path_to_watch, ec)) {
+        if (inotifyFd >= 0 && file.is_directory())
+            addWatch(file.path().string());
+    }
+#endif
+}
+
+/**
+ * Watch a directory (it may be already watched), if the watch limit is reached
+ * the inotify instance is closed and changes are detected by polling
+ * @param dir path of the directory
+ */
+void FileWatcher::addWatch(const std::string& dir) {
+#ifdef __linux__
+    int wd = inotify_add_watch(inotifyFd, dir.c_str(), IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd >= 0) {
+        watches[wd] = dir;
+    } else if (errno == ENOSPC || errno == ENOMEM) {
+        std::cout << "inotify watch limit reached, changes are detected by polling" << std::endl;
+        close(inotifyFd);
+        inotifyFd = -1;
+        watches.clear();
+    }
+#endif
+}
+
+/**
+ * Wait for inotify events or for the acks of the operations in flight (or just sleep when polling)
+ * @param deadline time at which the wait ends
+ * @return true if some events or acks are ready to be read, false if the deadline is reached
+ */
+bool FileWatcher::waitEvents(std::chrono::steady_clock::time_point deadline) {
+#ifdef __linux__
+    bool acks = !inflight.empty() && !sockerr;
+    if (inotifyFd >= 0 || acks) {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        struct pollfd pfd[2];
+        int n = 0;
+        if (inotifyFd >= 0)
+            pfd[n++] = {inotifyFd, POLLIN, 0};
+        if (acks)
+            pfd[n++] = {socket.native_handle(), POLLIN, 0};
+        return poll(pfd, n, ms > 0 ? int(ms) : 0) > 0;
+    }
+#endif
+    std::this_thread::sleep_until(deadline);
+    return false;
+}
+
+/**
+ * Read the pending inotify events and send the operations for the changed entries. Files are sent
+ * when closed after writing, new directories are watched and scanned (entries may be created before the watch)
+ */
+void FileWatcher::readEvents() {
+#ifdef __linux__
+    alignas(struct inotify_event) char buf[64 * 1024];
+    ssize_t len;
+
+    while (inotifyFd >= 0 && (len = read(inotifyFd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+            auto ev = (const struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                rescan = true;
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                watches.erase(ev->wd);
+                continue;
             }
+            auto w = watches.find(ev->wd);
+            if (w == watches.end() || ev->len == 0)
+                continue;
+            std::string path = w->second + "/" + ev->name;
 
-            // File modification
-            else {
-                if(paths_[file.path().string()] != current_file_last_write_time) {
-                    paths_[file.path().string()] = current_file_last_write_time;
-                    if (!fs::is_directory(file.path().string())) {
-                        std::cout<<"File modified: "<<file.path().string()<<std::endl;
-                        trace_map[file.path().string()]={'I', FileStatus::modified};
-                        result=sendMessage(FileStatus::modified, file.path().string());
-                        if(result){
-                            trace_map[file.path().string()].first='V';
-                            std::cout<<"Server ok!"<<std::endl;
-                        }
-                        else
-                            std::cout<<"Server error!"<<std::endl;
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                checkErased(path);
+                // The content of a directory moved away is gone as well
+                if (ev->mask & IN_ISDIR) {
+                    std::vector<std::string> inside;
+                    for (auto &e : paths_)
+                        if (e.first.compare(0, path.size() + 1, path + "/") == 0)
+                            inside.push_back(e.first);
+                    for (auto &e : inside)
+                        checkErased(e);
+                }
+            } else if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    addWatch(path);
+                    checkEntry(path);
+                    std::error_code ec;
+                    for (auto &file : std::filesystem::recursive_directory_iterator(path, ec)) {
+                        if (inotifyFd >= 0 && file.is_directory())
+                            addWatch(file.path().string());
+                        checkEntry(file.path().string());
                     }
                 }
+            } else {
+                // A created file is seen at once (also a hard link, which has no write), then when written, the writes
+                // of a file kept open (e.g. a log) as well: it is sent once settled (see settle())
+                checkEntry(path);
             }
         }
-
-        if( (sockerr && checkConnection()) || serverr || loops>=PROBETIME){
-            if(loops>=PROBETIME)
-                loops=0;
-            for(auto &m: trace_map)
-                m.second.first='I';
-            probe();
-        }
     }
+    // Moves are matched within the events read together
+    flushErased();
+#endif
 }
 
 /**
@@ -173,28 +547,18 @@ bool FileWatcher::clientLogin(){
         }
 
         mex=Message{login,user,std::vector<char>(pass.begin(),pass.end())};
-        boost::asio::write(socket,boost::asio::buffer(mex.getJSON()),err);
+        boost::asio::write(socket,boost::asio::buffer(mex.getFrame(BINARY_PROTOCOL)),err);
         if(err){
             printErr = true;
             continue;
         }
 
-        std::vector<char> buf(MAX_MSG_LEN);
-        boost::asio::read(socket,boost::asio::buffer(buf, MAX_MSG_LEN), err);
+        readMessage(mex, err);
         if(err){
             printErr = true;
             continue;
         }
 
-        int n = std::stoi(buf.data());
-        buf.resize(n);
-        boost::asio::read(socket, boost::asio::buffer(buf, n), err);
-        if(err){
-            printErr = true;
-            continue;
-        }
-
-        mex.parseJSON(buf);
         if(mex.getOpcode()==error){
             rewrite=true;
             std::cout<<"Login error!"<<std::endl<<"Insert username: ";
@@ -219,9 +583,37 @@ bool FileWatcher::clientLogin(){
         outfile.close();
     }
 
+    if(cnt < 5)
+        negotiateChunkSize();
+
     return cnt < 5;
 }
 
+/**
+ * Ask the server to use CHUNK_SIZE bytes data chunks for this session.
+ * The default MAX_BODY_LEN is kept if the server refuses it or on socket errors.
+ */
+void FileWatcher::negotiateChunkSize(){
+    boost::system::error_code err;
+    Message mex{set_chunk, std::to_string(CHUNK_SIZE)};
+    chunkSize=MAX_BODY_LEN;
+
+    boost::asio::write(socket, boost::asio::buffer(mex.getFrame(BINARY_PROTOCOL)), err);
+    if(err)
+        return;
+    readMessage(mex, err);
+    if(err || mex.getOpcode()!=ok)
+        return;
+
+    try{
+        std::size_t accepted=std::stoul(mex.getFilePath());
+        if(accepted>0 && accepted<=CHUNK_SIZE)
+            chunkSize=accepted;
+    } catch(const std::exception& exc){
+        std::cout<<"Invalid chunk size from server"<<std::endl;
+    }
+}
+
 /**
  * Method for re-establish a connection with the server after a connection problem
  * @return true if success, false instead
@@ -232,18 +624,13 @@ bool FileWatcher::checkConnection(){
 
     // Try with a ping to check if connection is already re-established
     msg.setOpcode(ping);
-    boost::asio::write(socket, boost::asio::buffer(msg.getJSON()), err);
+    boost::asio::write(socket, boost::asio::buffer(msg.getFrame(BINARY_PROTOCOL)), err);
 
     boost::asio::ip::tcp::socket::bytes_readable b;
     socket.io_control(b);
     // If we get a response for the ping, we clean the socket and return true
     if(b.get() > 0) {
-        std::vector<char> buf(MAX_MSG_LEN);
-        boost::asio::read(socket, boost::asio::buffer(buf, MAX_MSG_LEN), err);
-        int n = std::stoi(buf.data());
-        buf.resize(n);
-        boost::asio::read(socket, boost::asio::buffer(buf, n), err);
-        msg.parseJSON(buf);
+        readMessage(msg, err);
         return true;
         // Else we try to close and connect again the socket
     } else{
@@ -258,195 +645,926 @@ bool FileWatcher::checkConnection(){
 }
 
 /**
- * Method for sending a message to the server, basing on the parameters
+ * Read a message (JSON or binary frame) from the socket
+ * @param mex Message to be filled with the received one
+ * @param err error code of the socket operations
+ */
+void FileWatcher::readMessage(Message& mex, boost::system::error_code& err){
+    std::vector<char> buf(MAX_MSG_LEN);
+    boost::asio::read(socket, boost::asio::buffer(buf, MAX_MSG_LEN), err);
+    if(err)
+        return;
+
+    if(Message::isBinaryFrame(buf)){
+        buf.resize(BIN_HEADER_LEN);
+        boost::asio::read(socket, boost::asio::buffer(buf.data() + MAX_MSG_LEN, BIN_HEADER_LEN - MAX_MSG_LEN), err);
+        if(err)
+            return;
+        std::size_t n = Message::getBinaryBodyLen(buf);
+        buf.resize(BIN_HEADER_LEN + n);
+        boost::asio::read(socket, boost::asio::buffer(buf.data() + BIN_HEADER_LEN, n), err);
+        if(!err)
+            mex.parseBinary(buf);
+    } else{
+        int n = std::stoi(std::string(buf.begin(), buf.end()));
+        buf.resize(n);
+        boost::asio::read(socket, boost::asio::buffer(buf, n), err);
+        if(!err)
+            mex.parseJSON(buf);
+    }
+}
+
+/**
+ * Write a message on the socket (socket errors are handled here)
+ * @param mex Message to be sent
+ * @return true if success, false on socket errors
+ */
+bool FileWatcher::writeMessage(Message& mex){
+    boost::system::error_code err;
+    boost::asio::write(socket, boost::asio::buffer(mex.getFrame(BINARY_PROTOCOL)), err);
+    if(err){
+        socketError();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Handle an error on the socket: the acks of the operations in flight are lost,
+ * the next probe will sync them again
+ */
+void FileWatcher::socketError(){
+    std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
+    sockerr=true;
+    inflight.clear();
+    retryQueue.clear();
+    uploads.clear();
+}
+
+/**
+ * Method for sending an operation to the server, basing on the parameters.
+ * The operation is not acknowledged here: up to WINDOW_SIZE operations are kept
+ * in flight and their acks are matched by sequence number in receiveAck()
  * @param status is the type of operation to be done
  * @param path is the path of the entry on which execute the operation
- * @return true if server ack is OK, false if it is "Error"
+ * @param retry is the number of times the operation has already been refused by the server
+ * @param from is the old path of the entry (rename only)
+ * @return true if the operation has been sent, false on errors
  */
-bool FileWatcher::sendMessage(FileStatus status, const std::string& path){
+bool FileWatcher::sendMessage(FileStatus status, const std::string& path, int retry, const std::string& from){
     Message mex{};
-    boost::system::error_code err;
+    std::uint32_t seq=nextSeq++;
+    int acks=0;
+    std::ifstream in;
+
+    if(sockerr)
+        return false;
+
+    // Operation for create a file, also for modified: the file must be readable
+    if(status == FileStatus::created || status == FileStatus::modified){
+        in.open(path, std::fstream::in | std::ios::binary | std::ios_base::ate);
+        if(in.fail()){
+            std::cout<<"Error on opening file: "<<path<<std::endl;
+            serverr=true;
+            return false;
+        }
+    }
+
     // Operation for the probe method
     if(status == FileStatus::check){
         if(std::filesystem::is_directory(path)){
             mex=Message{check_dir,path.substr(path_to_watch.size()+1)};
 
         } else{
-            std::string filehash=computeFileHash(path);
+            std::string filehash=fileHash(path);
             mex=Message{check_file, path.substr(path_to_watch.size()+1),std::vector(filehash.begin(),filehash.end())};
         }
-        boost::asio::write(socket, boost::asio::buffer(mex.getJSON()), err);
-        if(err){
-            std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-            sockerr=true;
+        mex.setSeq(seq);
+        if(!writeMessage(mex))
             return false;
-        }
+        acks++;
     }
     // Operation for create a directory
     if(status == FileStatus::dir_created){
         mex=Message{create_dir, path.substr(path_to_watch.size()+1)};
-        boost::asio::write(socket, boost::asio::buffer(mex.getJSON()), err);
-        if(err){
-            std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-            sockerr=true;
+        mex.setSeq(seq);
+        if(!writeMessage(mex))
             return false;
-        }
+        acks++;
     }
-    // Operation for erase an entry, also for modified (= erase + create)
-    if(status == FileStatus::erased || status == FileStatus::modified){
+    // Operation for rename an entry, the new path is in the data
+    if(status == FileStatus::renamed){
+        std::string to=path.substr(path_to_watch.size()+1);
+        mex=Message{fs::is_directory(path) ? rename_dir : rename_file, from.substr(path_to_watch.size()+1), std::vector<char>(to.begin(), to.end())};
+        mex.setSeq(seq);
+        if(!writeMessage(mex))
+            return false;
+        acks++;
+    }
+    // Operation for a large modified file: the block signatures of the server copy are asked, only the
+    // differences are sent (see startDelta())
+    bool delta=!CHUNK_STORE && status == FileStatus::modified && retry == 0 && std::uintmax_t(in.tellg()) >= DELTA_MIN_SIZE;
+    if(delta){
+        mex=Message{get_signature, path.substr(path_to_watch.size()+1)};
+        mex.setSeq(seq);
+        if(!writeMessage(mex))
+            return false;
+        acks++;
+    }
+    // Operation for create a file stored as chunks: the chunks are checked on the server, only the missing
+    // ones are uploaded (see checkChunks()), a chunk has to fit in a message
+    std::vector<Chunk> chunks;
+    std::string fileDigest;
+    bool chunked=false;
+    if(CHUNK_STORE && (status == FileStatus::created || status == FileStatus::modified) &&
+       std::uintmax_t(in.tellg()) >= CONTENT_MATCH_SIZE && chunkSize >= CDC_MAX_SIZE + 1 + MAX_HASH_LEN + 4){
+        if(!checkChunks(path, seq, chunks, fileDigest, acks))
+            return false;
+        chunked=!chunks.empty();
+    }
+    // Operation for erase an entry
+    if(status == FileStatus::erased){
         mex=Message{remove_entry, path.substr(path_to_watch.size()+1)};
-        boost::asio::write(socket, boost::asio::buffer(mex.getJSON()), err);
-        if(err){
-            std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-            sockerr=true;
+        mex.setSeq(seq);
+        if(!writeMessage(mex))
             return false;
+        acks++;
+    }
+    // Operation for create a file, also for modified: the new content replaces the stored one only once it is
+    // complete on the server. The server is asked first if it already stores the same content (moved, copied
+    // or reverted files), otherwise the file is sent as a stream interleaved with the other uploads, see sendChunks()
+    bool query=false;
+    if((status == FileStatus::created || status == FileStatus::modified) && !delta && !chunked) {
+        std::string digest;
+        if(retry == 0 && std::uintmax_t(in.tellg()) >= CONTENT_MATCH_SIZE)
+            digest=fileHash(path);
+        if(!digest.empty()){
+            mex=Message{have_content, path.substr(path_to_watch.size()+1)};
+            mex.setDataHash(digest);
+            mex.setSeq(seq);
+            if(!writeMessage(mex))
+                return false;
+            query=true;
+        } else {
+            Upload &up=uploads.emplace_back();
+            up.seq=seq;
+            up.path=path;
+            up.size=std::filesystem::file_size(path);
+            in.seekg(0, std::ios_base::beg);
+            up.in=std::move(in);
         }
+        acks++;
     }
-    // Operation for create a file, also for modified (= erase + create)
-    if((status == FileStatus::created || status == FileStatus::modified)) {
-        std::ifstream in;
-        in.open(path, std::fstream::in | std::ios::binary | std::ios_base::ate);
-        if(in.fail()){
-            std::cout<<"Error on opening file: "<<path<<std::endl;
-            serverr=true;
+
+    Operation &op=inflight[seq]={status, path, acks, retry};
+    op.query=query;
+    op.delta=delta;
+    op.chunks=std::move(chunks);
+    op.fileDigest=fileDigest;
+    waitWindow();
+
+    return !sockerr;
+}
+
+/**
+ * Upload a file whose content is not stored on the server
+ * @param status is the type of operation (created or modified)
+ * @param path is the path of the file
+ * @param retry is the number of times the operation has already been refused by the server
+ */
+void FileWatcher::startUpload(FileStatus status, const std::string& path, int retry){
+    std::uint32_t seq=nextSeq++;
+    std::ifstream in(path, std::fstream::in | std::ios::binary);
+    if(in.fail()){
+        std::cout<<"Error on opening file: "<<path<<std::endl;
+        serverr=true;
+        return;
+    }
+
+    Upload &up=uploads.emplace_back();
+    up.seq=seq;
+    up.path=path;
+    up.size=std::filesystem::file_size(path);
+    up.in=std::move(in);
+    inflight[seq]={status, path, 1, retry};
+}
+
+/**
+ * Start the delta transfer of a modified file: the file is read once, moving a rolling checksum
+ * one byte at a time over it, and every window matching a block of the server copy (rolling and strong
+ * checksum) is sent as a reference to that block, the bytes in between as literal runs
+ * @param path is the path of the file
+ * @param signature is the data of the ack of get_signature (block size and block signatures)
+ * @param retry is the number of times the operation has already been refused by the server
+ * @return true if the upload has been started, false if the whole file has to be uploaded
+ */
+bool FileWatcher::startDelta(const std::string& path, const std::vector<char>& signature, int retry){
+    std::size_t offset=0;
+    std::uint32_t blockSize, weak;
+    std::string strong;
+    if(!Message::getUint32(signature, offset, blockSize) || blockSize == 0)
+        return false;
+    // Blocks of the server copy by rolling checksum
+    std::unordered_multimap<std::uint32_t, std::pair<std::uint32_t, std::string>> blocks;
+    for(std::uint32_t block=0; Message::readBlockSignature(signature, offset, weak, strong); block++)
+        blocks.emplace(weak, std::make_pair(block, strong));
+
+    std::ifstream in(path, std::fstream::in | std::ios::binary);
+    std::error_code err;
+    std::uint64_t size=fs::file_size(path, err);
+    if(in.fail() || err)
+        return false;
+
+    // Bytes of the file from bufStart, the file is read sequentially and the bytes before the window dropped
+    std::vector<char> buf;
+    std::uint64_t bufStart=0;
+    HashStream digest;
+    auto fill=[&](std::uint64_t pos, std::uint64_t end){
+        if(end <= bufStart + buf.size())
+            return true;
+        buf.erase(buf.begin(), buf.begin() + (pos - bufStart));
+        bufStart=pos;
+        std::size_t old=buf.size();
+        buf.resize(old + std::max<std::uint64_t>(end - bufStart - old, CHUNK_SIZE));
+        in.read(buf.data() + old, buf.size() - old);
+        buf.resize(old + in.gcount());
+        digest.update(buf.data() + old, in.gcount());
+        return end <= bufStart + buf.size();
+    };
+
+    std::vector<Upload::Run> runs;
+    std::uint64_t pos=0, literal=0;
+    std::uint32_t sum=0;
+    bool rolling=false;
+    while(pos + blockSize <= size){
+        if(!fill(pos, pos + blockSize))
             return false;
+        const char* window=buf.data() + (pos - bufStart);
+        if(!rolling){
+            sum=computeRollingChecksum(window, blockSize);
+            rolling=true;
+        }
+        auto range=blocks.equal_range(sum);
+        if(range.first != range.second){
+            std::string blockDigest=computeBlockDigest(window, blockSize);
+            auto match=std::find_if(range.first, range.second, [&](const auto& b){ return b.second.second == blockDigest; });
+            if(match != range.second){
+                if(literal < pos)
+                    runs.push_back({false, literal, pos - literal});
+                std::uint32_t block=match->second.first;
+                if(!runs.empty() && runs.back().copy && runs.back().start + runs.back().len == block)
+                    runs.back().len++;
+                else
+                    runs.push_back({true, block, 1});
+                pos+=blockSize;
+                literal=pos;
+                rolling=false;
+                continue;
+            }
         }
+        if(pos + blockSize == size)
+            break;
+        if(!fill(pos, pos + blockSize + 1))
+            return false;
+        window=buf.data() + (pos - bufStart);
+        sum=rollChecksum(sum, window[0], window[blockSize], blockSize);
+        pos++;
+    }
+    if(literal < size)
+        runs.push_back({false, literal, size - literal});
+    // The rest of the file, for its digest (a file changed in the meantime is uploaded whole)
+    std::uint64_t read=bufStart + buf.size();
+    buf.resize(CHUNK_SIZE);
+    while(in.read(buf.data(), buf.size()) || in.gcount() > 0){
+        digest.update(buf.data(), in.gcount());
+        read+=in.gcount();
+    }
+    if(read != size)
+        return false;
+    in.clear();
 
-        int size = std::filesystem::file_size(path);
-        int read = 0;
+    std::uint32_t seq=nextSeq++;
+    Upload &up=uploads.emplace_back();
+    up.seq=seq;
+    up.path=path;
+    up.in=std::move(in);
+    up.delta=true;
+    up.blockSize=blockSize;
+    up.runs=std::move(runs);
+    up.fileDigest=digest.final();
+    inflight[seq]={FileStatus::modified, path, 1, retry};
+    return true;
+}
 
-        //Empty file created
-        if(size==0){
-            mex=Message{create_file, path.substr(path_to_watch.size() + 1), std::vector<char>{}};
-            boost::asio::write(socket, boost::asio::buffer(mex.getJSON()),err);
-            if(err){
-                std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-                sockerr=true;
-                return false;
-            }
-        } else {
-            //Non empty file created
-            while (read < size) {
-                int rem = size - read;
-                int buffersize = (rem < MAX_BODY_LEN) ? rem : MAX_BODY_LEN;
-                char buf[MAX_BODY_LEN];
-                in.seekg(read, std::ios_base::beg);
-                in.read(buf, buffersize);
-                read += buffersize;
-                std::vector<char> vec(buf, buf + buffersize);
-                mex = Message{create_file, path.substr(path_to_watch.size() + 1), vec};
-                boost::asio::write(socket, boost::asio::buffer(mex.getJSON()), err);
-                if(err){
-                    std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-                    sockerr=true;
-                    return false;
-                }
-            }
+/**
+ * Fill the data of the next put_delta message of a delta transfer: block size, then as many runs as fit in a chunk
+ * (literal runs are split across messages, their bytes are read from the file)
+ * @param up is the upload
+ * @param data is the data of the message (empty if every run has been sent)
+ */
+void FileWatcher::nextDelta(Upload& up, std::vector<char>& data){
+    Message::putUint32(data, up.blockSize);
+    std::size_t header=data.size();
+    // A run takes at most 9 bytes besides its literal bytes
+    while(up.next < up.runs.size() && data.size() + 9 <= chunkSize){
+        Upload::Run &run=up.runs[up.next];
+        if(run.copy){
+            data.push_back('C');
+            Message::putUint32(data, run.start);
+            Message::putUint32(data, run.len);
+            up.next++;
+            continue;
         }
+        std::size_t n=std::min<std::uint64_t>(chunkSize - data.size() - 5, run.len - up.sent);
+        data.push_back('L');
+        Message::putUint32(data, n);
+        std::size_t old=data.size();
+        data.resize(old + n);
+        up.in.seekg(run.start + up.sent);
+        up.in.read(data.data() + old, n);
+        // The file has been truncated in the meantime: the server refuses the rebuilt file (digest mismatch)
+        if(std::size_t(up.in.gcount()) != n){
+            data.resize(old - 5);
+            up.in.clear();
+            up.next=up.runs.size();
+            break;
+        }
+        up.sent+=n;
+        if(up.sent == run.len){
+            up.sent=0;
+            up.next++;
+        }
+    }
+    if(data.size() == header && up.started)
+        data.clear();
+}
 
-        //Signal end of file transfer
-        sendEOP(path);
+/**
+ * Split a file in content-defined chunks and ask the server which ones it stores: the digests are sent
+ * in check_chunks messages (as many as needed), each one acknowledged with the bitmap of its chunks
+ * @param path is the path of the file
+ * @param seq is the sequence number of the operation
+ * @param chunks are the chunks of the file
+ * @param digest is the digest of the whole file
+ * @param acks is the number of acks of the operation (incremented for every message)
+ * @return true if success, false on errors
+ */
+bool FileWatcher::checkChunks(const std::string& path, std::uint32_t seq, std::vector<Chunk>& chunks, std::string& digest, int& acks){
+    HashStream whole, chunk;
+    std::uint64_t offset=0;
+    bool ok=splitFile(path, [&](const char* data, std::size_t len){
+        unsigned char raw[MAX_HASH_LEN];
+        std::size_t n;
+        whole.update(data, len);
+        chunk.update(data, len);
+        if(!hexToBytes(chunk.final(), raw, MAX_HASH_LEN, n))
+            return false;
+        chunks.push_back({offset, std::uint32_t(len), std::string((const char*)raw, n)});
+        offset+=len;
+        return true;
+    });
+    if(!ok){
+        std::cout<<"Error on reading file: "<<path<<std::endl;
+        serverr=true;
+        return false;
     }
+    digest=whole.final();
 
-    int i=(status==FileStatus::modified ? 0 : 1);
-    bool msgerr=false;
-    //Ack receiving
-    do{
-        std::vector<char> buf(MAX_MSG_LEN);
-        boost::asio::read(socket,boost::asio::buffer(buf, MAX_MSG_LEN), err);
-        if(err){
-            std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-            sockerr=true;
+    // Slices of a multiple of 8 chunks, so that the bitmaps of the acks can be joined
+    std::size_t slice=chunkSize / MAX_HASH_LEN / 8 * 8;
+    for(std::size_t i=0; i<chunks.size(); i+=slice){
+        std::vector<char> data;
+        for(std::size_t j=i; j<chunks.size() && j<i+slice; j++)
+            data.insert(data.end(), chunks[j].digest.begin(), chunks[j].digest.end());
+        Message mex{check_chunks, path.substr(path_to_watch.size()+1), std::move(data)};
+        mex.setSeq(seq);
+        if(!writeMessage(mex))
             return false;
+        acks++;
+    }
+    return true;
+}
+
+/**
+ * Upload the chunks of a file not stored on the server, the other ones are only referred to
+ * @param op is the completed check of the chunks
+ */
+void FileWatcher::startChunks(const Operation& op){
+    std::ifstream in(op.path, std::fstream::in | std::ios::binary);
+    if(in.fail()){
+        std::cout<<"Error on opening file: "<<op.path<<std::endl;
+        serverr=true;
+        return;
+    }
+
+    std::uint32_t seq=nextSeq++;
+    Upload &up=uploads.emplace_back();
+    up.seq=seq;
+    up.path=op.path;
+    up.in=std::move(in);
+    up.chunked=true;
+    up.chunks=op.chunks;
+    up.stored=op.reply;
+    up.fileDigest=op.fileDigest;
+    inflight[seq]={op.status, op.path, 1, op.retries};
+}
+
+/**
+ * Fill the data of the next put_chunks message of a file: as many chunks as fit in a message, the ones
+ * stored on the server as references, the others with their bytes read from the file
+ * @param up is the upload
+ * @param data is the data of the message (empty if every chunk has been sent)
+ */
+void FileWatcher::nextChunks(Upload& up, std::vector<char>& data){
+    while(up.next < up.chunks.size()){
+        const Chunk &c=up.chunks[up.next];
+        bool stored=up.next/8 < up.stored.size() && (up.stored[up.next/8] & (1<<(up.next%8)));
+        if(data.size() + 1 + MAX_HASH_LEN + 4 + (stored ? 0 : c.len) > chunkSize)
+            break;
+        data.push_back(stored ? 'R' : 'D');
+        data.insert(data.end(), c.digest.begin(), c.digest.end());
+        Message::putUint32(data, c.len);
+        if(!stored){
+            std::size_t old=data.size();
+            data.resize(old + c.len);
+            up.in.seekg(c.offset);
+            up.in.read(data.data() + old, c.len);
+            // The file has been truncated in the meantime: the server refuses the chunk (digest mismatch)
+            if(std::size_t(up.in.gcount()) != c.len)
+                up.in.clear();
         }
-        int n = std::stoi(buf.data());
-        buf.resize(n);
-        boost::asio::read(socket, boost::asio::buffer(buf, n), err);
-        if(err){
-            std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-            sockerr=true;
-            return false;
+        up.next++;
+    }
+}
+
+/**
+ * Method for sending a batch of entries to be checked by the server during the probe,
+ * the entries stored on the server are set to VALID when the ack is received
+ * @param opc is check_batch (entries) or check_tree (Merkle tree hashes of directories)
+ * @param batch is the data of the message (emptied)
+ * @param paths are the paths of the entries in the batch (emptied)
+ * @return true if the batch has been sent, false on errors
+ */
+bool FileWatcher::sendCheckBatch(Action opc, std::vector<char>& batch, std::vector<std::string>& paths){
+    std::uint32_t seq=nextSeq++;
+
+    if(sockerr)
+        return false;
+
+    Message mex{opc, "", std::move(batch)};
+    batch.clear();
+    mex.setSeq(seq);
+    if(!writeMessage(mex))
+        return false;
+
+    Operation &op=inflight[seq]={FileStatus::check, "", 1, 0};
+    op.batch=std::move(paths);
+    op.tree=opc == check_tree;
+    paths.clear();
+    waitWindow();
+
+    return !sockerr;
+}
+
+/**
+ * Add an entry to a batch to be checked by the server, the batch is sent when full
+ * @param opc is check_batch (entries) or check_tree (Merkle tree hashes of directories)
+ * @param batch is the data of the message
+ * @param paths are the paths of the entries in the batch
+ * @param path is the path of the entry
+ * @param hash is the digest of the file or the tree hash of the directory (empty for a directory entry)
+ */
+void FileWatcher::addCheckEntry(Action opc, std::vector<char>& batch, std::vector<std::string>& paths, const std::string& path, const std::string& hash){
+    std::string rel=path.size() > path_to_watch.size() ? path.substr(path_to_watch.size()+1) : "";
+    if(!paths.empty() && batch.size() + Message::getCheckEntryLen(rel, hash) > chunkSize)
+        sendCheckBatch(opc, batch, paths);
+    if(Message::appendCheckEntry(batch, rel, hash))
+        paths.push_back(path);
+}
+
+/**
+ * Digest of a file, computed again only if the file changed since the last time (same device, inode, size and last write time)
+ * @param path path of the file
+ * @return hex representation of the SHA3-256 digest (empty string on errors)
+ */
+std::string FileWatcher::fileHash(const std::string& path){
+    FileId id;
+    std::error_code ec;
+    std::int64_t size=std::int64_t(fs::file_size(path, ec));
+    std::int64_t mtime=ec ? 0 : std::int64_t(fs::last_write_time(path, ec).time_since_epoch().count());
+    // Without inode numbers (e.g. on Windows) the files can't be told apart, the digest is always computed
+    if(ec || !fileId(path, id) || id.second==0)
+        return computeFileHash(path);
+
+    auto it=hashCache.find(id);
+    if(it!=hashCache.end() && it->second.size==size && it->second.mtime==mtime){
+        it->second.used=true;
+        return it->second.digest;
+    }
+
+    std::string digest=computeFileHash(path);
+    if(!digest.empty()){
+        hashCache[id]={size, mtime, digest, true};
+        hashCacheDirty=true;
+    }
+    return digest;
+}
+
+/**
+ * Load the cache of the file digests saved by the previous runs
+ */
+void FileWatcher::loadHashCache(){
+    std::ifstream ifs(HASH_CACHE_FILE);
+    std::string line;
+    FileId id;
+    CachedHash entry{0, 0, "", false};
+
+    if(ifs.fail())
+        return;
+    // Lines not made of device, inode, size, last write time and digest (e.g. of an older format) are skipped
+    while(std::getline(ifs, line)){
+        std::istringstream fields(line);
+        if(fields >> id.first >> id.second >> entry.size >> entry.mtime >> entry.digest)
+            hashCache[id]=entry;
+    }
+}
+
+/**
+ * Save the cache of the file digests, only the digests used since the last save are kept
+ */
+void FileWatcher::saveHashCache(){
+    for(auto it=hashCache.begin(); it!=hashCache.end();){
+        if(!it->second.used){
+            it=hashCache.erase(it);
+            hashCacheDirty=true;
+        } else
+            it++;
+    }
+    if(!hashCacheDirty)
+        return;
+
+    // Written aside and renamed, a crash never leaves a truncated cache
+    std::string tmp=std::string(HASH_CACHE_FILE) + ".tmp";
+    std::ofstream ofs(tmp, std::ios::trunc);
+    for(auto &e: hashCache){
+        ofs << e.first.first << " " << e.first.second << " " << e.second.size << " " << e.second.mtime << " " << e.second.digest << "\n";
+        e.second.used=false;
+    }
+    ofs.close();
+    std::error_code ec;
+    if(ofs.fail()){
+        std::cout<<"Error on saving the hash cache"<<std::endl;
+        std::filesystem::remove(tmp, ec);
+        return;
+    }
+    std::filesystem::rename(tmp, HASH_CACHE_FILE, ec);
+    if(ec)
+        std::cout<<ec.message()<<std::endl;
+    hashCacheDirty=false;
+}
+
+/**
+ * Compute the Merkle tree of the watched directory from the maps (erased entries excluded)
+ */
+void FileWatcher::computeTree(){
+    treeHashes.clear();
+    children.clear();
+    for(auto &m: trace_map){
+        if(m.second.second == FileStatus::erased || m.first.size() <= path_to_watch.size())
+            continue;
+        children[m.first.substr(0, m.first.rfind('/'))].push_back(m.first);
+    }
+    treeHash(path_to_watch);
+}
+
+/**
+ * Compute the Merkle tree hash of a directory and of all its subdirectories
+ * @param dir path of the directory
+ * @return hex representation of the tree hash
+ */
+std::string FileWatcher::treeHash(const std::string& dir){
+    std::vector<std::pair<std::string, std::string>> entries;
+    for(auto &c: children[dir]){
+        if(trace_map[c].second == FileStatus::dir_created)
+            entries.emplace_back(c.substr(dir.size()+1), "d" + treeHash(c));
+        else
+            entries.emplace_back(c.substr(dir.size()+1), "f" + fileHash(c));
+    }
+
+    std::string hash=computeTreeHash(entries);
+    treeHashes[dir]=hash;
+    return hash;
+}
+
+/**
+ * Set to VALID a directory and all its entries (its subtree is the same on the server)
+ * @param dir path of the directory
+ */
+void FileWatcher::markValid(const std::string& dir){
+    auto entry=trace_map.find(dir);
+    if(entry!=trace_map.end())
+        entry->second.first='V';
+    for(auto &c: children[dir]){
+        auto &m=trace_map[c];
+        m.first='V';
+        if(m.second == FileStatus::dir_created)
+            markValid(c);
+    }
+}
+
+/**
+ * Window full: keep sending the uploads and wait for the oldest acks before sending anything else
+ */
+void FileWatcher::waitWindow(){
+    while((inflight.size() >= WINDOW_SIZE || uploads.size() >= MAX_STREAMS) && !sockerr){
+        if(!uploads.empty())
+            sendChunks();
+        else
+            receiveAck();
+    }
+}
+
+/**
+ * Receive an ack from the server and match it with the operation in flight with the same sequence number
+ * @return true if success, false on socket errors
+ */
+bool FileWatcher::receiveAck(){
+    Message mex{};
+    boost::system::error_code err;
+
+    readMessage(mex, err);
+    if(err){
+        socketError();
+        return false;
+    }
+
+    auto it=inflight.find(mex.getSeq());
+    if(it==inflight.end())
+        return true;
+    if(mex.getOpcode() == error)
+        it->second.failed=true;
+    // The block signatures of the server copy of a file for a delta transfer
+    else if(it->second.delta)
+        it->second.reply=mex.getFileData();
+    // The bitmaps of the chunks stored on the server, one for every slice of the chunks in order
+    else if(!it->second.chunks.empty())
+        it->second.reply.insert(it->second.reply.end(), mex.getFileData().begin(), mex.getFileData().end());
+    // The bitmap of a batched check tells which entries (or whole subtrees) are stored on the server
+    else if(!it->second.batch.empty()){
+        const std::vector<char>& bitmap=mex.getFileData();
+        for(std::size_t i=0; i<it->second.batch.size(); i++){
+            bool stored=i/8<bitmap.size() && (bitmap[i/8] & (1<<(i%8)));
+            if(it->second.tree){
+                if(stored)
+                    markValid(it->second.batch[i]);
+                else
+                    treeMismatch.push_back(it->second.batch[i]);
+            } else if(stored){
+                auto entry=trace_map.find(it->second.batch[i]);
+                if(entry!=trace_map.end())
+                    entry->second.first='V';
+            }
         }
-        mex.parseJSON(buf);
-        if(mex.getOpcode() == error){
-            msgerr=true;
+    }
+    // An operation made of several messages (the slices of the chunk checks) receives an ack for every one
+    if(--it->second.acks > 0)
+        return true;
+
+    Operation op=std::move(it->second);
+    inflight.erase(it);
+    completeOperation(op);
+    return true;
+}
+
+/**
+ * Update the maps with the result of an acknowledged operation,
+ * operations refused by the server are queued to be sent again up to MAX_RETRY times
+ * @param op the completed operation
+ */
+void FileWatcher::completeOperation(const Operation& op){
+    // Signatures of the server copy received: only the differences are sent (the whole file if there is no copy)
+    if(op.delta && !sockerr){
+        if(op.failed || !startDelta(op.path, op.reply, op.retries))
+            startUpload(FileStatus::modified, op.path, op.retries);
+        return;
+    }
+    // Chunks checked: only the ones the server lacks are sent (the whole file if the server doesn't store chunks)
+    if(!op.chunks.empty() && !sockerr){
+        if(op.failed)
+            startUpload(op.status, op.path, op.retries);
+        else
+            startChunks(op);
+        return;
+    }
+    // Content not stored on the server: the file is uploaded
+    if(op.query && op.failed && !sockerr){
+        startUpload(FileStatus::created, op.path, op.retries);
+        return;
+    }
+    if(!op.failed){
+        auto entry=trace_map.find(op.path);
+        if(entry!=trace_map.end())
+            entry->second.first='V';
+        if(op.status!=FileStatus::check)
+            std::cout<<"Server ok!"<<std::endl;
+    }
+    // An error on a check only means the entry has to be synced
+    else if(op.status!=FileStatus::check){
+        std::cout<<"Server error!"<<std::endl;
+        // A refused rename is not sent again, the probe syncs the entries
+        if(op.retries < MAX_RETRY && op.status!=FileStatus::renamed)
+            retryQueue.push_back(op);
+        else
             serverr=true;
+    }
+}
+
+/**
+ * Send one chunk of every upload in progress (round robin, so that a large file doesn't
+ * delay the smaller ones) and the eop of the completed ones, then read the acks already received
+ */
+void FileWatcher::sendChunks(){
+    Message mex{};
+    // Whole file digest, needed only when chunks carry a plain checksum
+    bool fileDigest = (CHUNK_CHECKSUM == Checksum::crc32c);
+
+    for(auto it=uploads.begin(); it!=uploads.end() && !sockerr;){
+        Upload &up=*it;
+        std::size_t buffersize=0;
+        if(up.read < up.size && !up.delta && !up.chunked)
+            buffersize = (up.size - up.read < chunkSize) ? up.size - up.read : chunkSize;
+        std::vector<char> vec(buffersize);
+        if(up.delta)
+            nextDelta(up, vec);
+        else if(up.chunked)
+            nextChunks(up, vec);
+        else if(buffersize > 0){
+            up.in.read(vec.data(), buffersize);
+            vec.resize(up.in.gcount());
+            // The file may have been truncated in the meantime
+            if(vec.empty())
+                up.size = up.read;
+        }
+
+        // The first chunk is sent even if empty, so that empty files are created too
+        if(!vec.empty() || !up.started){
+            up.read += vec.size();
+            up.started = true;
+            if(fileDigest)
+                up.digest.update(vec.data(), vec.size());
+            mex = Message{up.delta ? put_delta : up.chunked ? put_chunks : create_file, up.path.substr(path_to_watch.size() + 1), std::move(vec), CHUNK_CHECKSUM};
+            mex.setSeq(up.seq);
+            mex.setStream(up.seq);
+            if(!writeMessage(mex))
+                return;
+            it++;
+        } else {
+            //Signal end of file transfer, the file rebuilt from a delta or chunks always carries its digest
+            if(!sendEOP(up.path, up.delta || up.chunked ? up.fileDigest : fileDigest ? up.digest.final() : "", up.seq, up.seq))
+                return;
+            it=uploads.erase(it);
+        }
+    }
+
+    boost::system::error_code err;
+    while(!sockerr && socket.available(err) > 0)
+        receiveAck();
+}
+
+/**
+ * Send the uploads in progress and handle the notified changes for a time slice
+ * @param time length of the time slice
+ */
+void FileWatcher::pump(std::chrono::duration<int, std::milli> time){
+    auto deadline=std::chrono::steady_clock::now() + time;
+    boost::system::error_code err;
+    while(std::chrono::steady_clock::now() < deadline){
+        // Acks already received, a file not found by a content lookup is uploaded
+        while(!sockerr && !inflight.empty() && socket.available(err) > 0)
+            receiveAck();
+        settle();
+        auto wake=settleDeadline(deadline);
+        if(!uploads.empty())
+            sendChunks();
+        else if(!waitEvents(wake) && wake == deadline)
+            break;
+        if(inotifyFd >= 0)
+            readEvents();
+    }
+}
+
+/**
+ * Wait for the acks of all the operations in flight, sending the uploads in progress and again the refused operations
+ */
+void FileWatcher::flush(){
+    while(!sockerr && (!inflight.empty() || !retryQueue.empty())){
+        if(!retryQueue.empty() && inflight.size() < WINDOW_SIZE){
+            Operation op=std::move(retryQueue.front());
+            retryQueue.pop_front();
+            sendMessage(op.status, op.path, op.retries + 1);
         }
-        i++;
-    }while(i<2); // If the status is modified (= erase + create), so 2 ack received
+        else if(!uploads.empty())
+            sendChunks();
+        else
+            receiveAck();
+    }
+}
 
-    return !msgerr;
+/**
+ * Erase from the maps the erased entries acknowledged by the server
+ */
+void FileWatcher::removeErased(){
+    for(auto it=trace_map.begin(); it!=trace_map.end();){
+        if(it->second.second == FileStatus::erased && it->second.first=='V'){
+            paths_.erase(it->first);
+            it=trace_map.erase(it);
+        }
+        else
+            it++;
+    }
 }
 
 /**
  * Method for sending the eop (end of operation)
  * @param path path for the operation done
+ * @param digest SHA3-256 digest of the whole file sent (if any)
+ * @param seq sequence number of the operation
+ * @param stream ID of the upload ended by the eop (0 for the end of a probe phase)
+ * @return true if success, false on socket errors
  */
-void FileWatcher::sendEOP(const std::string& path){
-    boost::system::error_code err;
+bool FileWatcher::sendEOP(const std::string& path, const std::string& digest, std::uint32_t seq, std::uint32_t stream){
     Message mex{eop,path.substr(path_to_watch.size() + 1)};
-    boost::asio::write(socket, boost::asio::buffer(mex.getJSON()), err);
-    if(err){
-        std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-        sockerr=true;
-    }
+    mex.setDataHash(digest);
+    mex.setSeq(seq);
+    mex.setStream(stream);
+    return writeMessage(mex);
 }
 
 /**
  * Method for the probe command (to sync server with client)
  */
 void FileWatcher::probe(){
-    bool result;
     Message mex{};
-    boost::system::error_code err;
     sockerr=serverr=false;
 
     // Start probe signal
     mex.setOpcode(start_probe);
-    boost::asio::write(socket, boost::asio::buffer(mex.getJSON()), err);
-    if(err){
-        std::cout<<"Socket error, connection will be resumed soon. All file modifications are monitored and saved."<<std::endl;
-        sockerr=true;
+    if(!writeMessage(mex))
         return;
-    }
 
-    // First phase: check message to server (with file hash if file). If the entry corresponds, server returns ok, error instead
-    for(auto &m: trace_map) {
-        if(m.second.first != 'V') {
-            result = sendMessage(FileStatus::check, m.first);
-            if (result)
-                // Set to VALID if an entry is valid
-                m.second.first='V';
+    // First phase: the Merkle tree hashes of the directories are compared starting from the root, only the
+    // directories that differ are descended: their entries are checked (with file hash if file) and their
+    // subdirectories are compared in turn. The server replies with a bitmap of the stored ones
+    for(auto &h: hashCache)
+        h.second.used=false;
+    computeTree();
+    std::vector<char> treeBatch, batch;
+    std::vector<std::string> treePaths, batchPaths;
+    addCheckEntry(check_tree, treeBatch, treePaths, path_to_watch, treeHashes[path_to_watch]);
+    while(!treePaths.empty() && !sockerr){
+        treeMismatch.clear();
+        sendCheckBatch(check_tree, treeBatch, treePaths);
+        if(!batchPaths.empty())
+            sendCheckBatch(check_batch, batch, batchPaths);
+        flush();
+
+        for(auto &dir: treeMismatch){
+            for(auto &c: children[dir]){
+                auto &m=trace_map[c];
+                // Acks set the entries to VALID
+                if(m.first == 'V')
+                    continue;
+                if(m.second == FileStatus::dir_created){
+                    addCheckEntry(check_batch, batch, batchPaths, c, "");
+                    addCheckEntry(check_tree, treeBatch, treePaths, c, treeHashes[c]);
+                } else
+                    addCheckEntry(check_batch, batch, batchPaths, c, fileHash(c));
+            }
         }
     }
+    if(!batchPaths.empty())
+        sendCheckBatch(check_batch, batch, batchPaths);
+    flush();
+
+    // Every file has been hashed for the tree, the digests of the files no more existing are dropped
+    saveHashCache();
 
     // Signaling end of check phase
     sendEOP(path_to_watch + "/eop");
 
     // Second phase: sending operations to sync the server
     for(auto &m: trace_map){
-        //Process only INVALID entries
-        if(m.second.first=='V')
-            continue;
-
-        result = sendMessage(m.second.second,m.first);
-        if(result)
-            // If server returns OK, set to VALID
-            m.second.first='V';
+        //Process only INVALID entries, set to VALID when the server returns OK
+        if(m.second.first!='V')
+            sendMessage(m.second.second,m.first);
     }
+    flush();
 
     //Signaling end of sync phase
     sendEOP(path_to_watch + "/eop");
 
     // Third phase: erase the erased entry from the maps
-    for(auto &m: trace_map){
-        if(m.second.second == FileStatus::erased && m.second.first=='V'){
-            auto it=paths_.find(m.first);
-            if(it!=paths_.end())
-                paths_.erase(it);
-            trace_map.erase(m.first);
-        }
-    }
+    removeErased();
 }
 
 /**
@@ -5,18 +5,28 @@
 #include <thread>
 #include <fcntl.h>
 #include <iostream>
+#include <fstream>
 #include <filesystem>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <unordered_map>
+#include <map>
+#include <deque>
+#include <list>
 #include <string>
+#include <sstream>
 #include <boost/asio.hpp>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 #include "../Common/Message.h"
 #include "../Common/Parameters.h"
 
 namespace fs = std::filesystem;
 
 // Define available file changes
-enum class FileStatus {created, modified, erased, dir_created, check};
+enum class FileStatus {created, modified, erased, dir_created, check, renamed};
 
 class FileWatcher {
 
@@ -29,6 +39,8 @@ public:
     // Keep a record of files from the base directory and their last modification time
     FileWatcher(boost::asio::ip::tcp::socket sock, std::chrono::duration<int, std::milli> delay);
 
+    ~FileWatcher();
+
     // Monitor "path_to_watch" for changes and in case of a change propagate it to the server
     void start();
 
@@ -40,17 +52,213 @@ private:
 
     std::unordered_map<std::string, std::pair<char, FileStatus>> trace_map;
 
+    // Identity of an entry on the disk (device and inode), kept for every entry to detect renames
+    using FileId = std::pair<std::uint64_t, std::uint64_t>;
+    std::unordered_map<std::string, FileId> ids;
+    // Entries disappeared during the current scan (or batch of events), by identity: an entry appearing
+    // with the same identity is a rename, the others are erased at the end of the scan
+    std::map<FileId, std::string> vanished;
+
+    // Content-defined chunk of a file (CHUNK_STORE): position, length and raw SHA3-256 digest
+    struct Chunk {
+        std::uint64_t offset;
+        std::uint32_t len;
+        std::string digest;
+    };
+
+    // Operation sent to the server and waiting for its acks
+    struct Operation {
+        FileStatus status=FileStatus::check;
+        std::string path;
+        int acks=0;
+        bool failed=false;
+        int retries=0;
+        // Paths of the entries of a batched check
+        std::vector<std::string> batch;
+        // The batch compares Merkle tree hashes of directories
+        bool tree=false;
+        // The file is looked up by digest on the server, it is uploaded if not found
+        bool query=false;
+        // The block signatures of the server copy are asked for a delta transfer
+        bool delta=false;
+        // Chunks of the file checked on the server (CHUNK_STORE) and digest of the whole file
+        std::vector<Chunk> chunks;
+        std::string fileDigest;
+        // Data of the acks: block signatures of a delta, bitmaps of the stored chunks
+        std::vector<char> reply;
+
+        Operation()=default;
+        Operation(FileStatus status, std::string path, int acks, int retries)
+                : status(status), path(std::move(path)), acks(acks), retries(retries) {}
+    };
+
+    // Operations in flight, by sequence number
+    std::unordered_map<std::uint32_t, Operation> inflight;
+
+    // Operations refused by the server, to be sent again
+    std::deque<Operation> retryQueue;
+
+    // File upload multiplexed on the connection, its stream ID is the sequence number of the operation
+    struct Upload {
+        std::uint32_t seq;
+        std::string path;
+        std::ifstream in;
+        std::uintmax_t size=0, read=0;
+        bool started=false;
+        HashStream digest;
+        // Delta transfer: runs of blocks of the server copy (first block and count) and literal runs
+        // of the file (offset and length), the next run to be sent and the bytes of it already sent
+        struct Run {
+            bool copy;
+            std::uint64_t start, len;
+        };
+        bool delta=false;
+        std::uint32_t blockSize=0;
+        std::vector<Run> runs;
+        std::size_t next=0;
+        std::uint64_t sent=0;
+        std::string fileDigest;
+        // Chunks of the file (CHUNK_STORE) and bitmap of the ones stored on the server, sent from the next one
+        bool chunked=false;
+        std::vector<Chunk> chunks;
+        std::vector<char> stored;
+    };
+
+    // Uploads in progress, served round robin one chunk at a time
+    std::list<Upload> uploads;
+
+    std::uint32_t nextSeq=1;
+
+    // Digests of the files by device and inode, valid while size and last write time are unchanged (saved in HASH_CACHE_FILE)
+    struct CachedHash {
+        std::int64_t size;
+        std::int64_t mtime;
+        std::string digest;
+        bool used;
+    };
+    std::map<FileId, CachedHash> hashCache;
+
+    bool hashCacheDirty=false;
+
+    // Merkle tree of the watched directory computed for the probe: tree hashes and entries of the directories
+    std::unordered_map<std::string, std::string> treeHashes;
+
+    std::unordered_map<std::string, std::vector<std::string>> children;
+
+    // Directories whose tree hash differs from the server one
+    std::vector<std::string> treeMismatch;
+
     bool running_ = true, sockerr=false, serverr=false;
 
     int loops=0;
 
+    // inotify instance (-1 if changes are detected by polling) and watched directories by watch descriptor
+    int inotifyFd=-1;
+
+    std::unordered_map<int, std::string> watches;
+
+    // Some events have been lost, the whole tree has to be scanned again
+    bool rescan=false;
+
+    // Files changed and not yet sent: the changes of a file are merged in one operation,
+    // sent when its size and last write time stay unchanged for SETTLE_TIME (see settle())
+    struct Change {
+        FileStatus status;
+        std::int64_t size, mtime;
+        std::chrono::steady_clock::time_point first, last;
+    };
+    std::unordered_map<std::string, Change> pending;
+
+    // Maximum data chunk length accepted by the server for this session
+    std::size_t chunkSize=MAX_BODY_LEN;
+
     bool clientLogin();
 
+    void initWatcher();
+
+    void addWatch(const std::string& dir);
+
+    bool waitEvents(std::chrono::steady_clock::time_point deadline);
+
+    void readEvents();
+
+    void scan();
+
+    void checkEntry(const std::string& path);
+
+    void checkErased(std::string path);
+
+    void flushErased();
+
+    bool fileId(const std::string& path, FileId& id);
+
+    bool checkRenamed(const std::string& path);
+
+    void renameEntries(const std::string& from, const std::string& to);
+
+    void deferChange(FileStatus status, const std::string& path);
+
+    bool dropChange(const std::string& path);
+
+    void settle();
+
+    std::chrono::steady_clock::time_point settleDeadline(std::chrono::steady_clock::time_point deadline);
+
     bool checkConnection();
 
-    bool sendMessage(FileStatus status, const std::string& path);
+    void negotiateChunkSize();
+
+    void readMessage(Message& mex, boost::system::error_code& err);
+
+    bool writeMessage(Message& mex);
+
+    void socketError();
+
+    bool sendMessage(FileStatus status, const std::string& path, int retry = 0, const std::string& from = "");
+
+    void startUpload(FileStatus status, const std::string& path, int retry);
+
+    bool startDelta(const std::string& path, const std::vector<char>& signature, int retry);
+
+    void nextDelta(Upload& up, std::vector<char>& data);
+
+    bool checkChunks(const std::string& path, std::uint32_t seq, std::vector<Chunk>& chunks, std::string& digest, int& acks);
+
+    void startChunks(const Operation& op);
+
+    void nextChunks(Upload& up, std::vector<char>& data);
+
+    bool sendCheckBatch(Action opc, std::vector<char>& batch, std::vector<std::string>& paths);
+
+    void addCheckEntry(Action opc, std::vector<char>& batch, std::vector<std::string>& paths, const std::string& path, const std::string& hash);
+
+    std::string fileHash(const std::string& path);
+
+    void loadHashCache();
+
+    void saveHashCache();
+
+    void computeTree();
+
+    std::string treeHash(const std::string& dir);
+
+    void markValid(const std::string& dir);
+
+    void waitWindow();
+
+    bool receiveAck();
+
+    void completeOperation(const Operation& op);
+
+    void sendChunks();
+
+    void pump(std::chrono::duration<int, std::milli> time);
+
+    void flush();
+
+    void removeErased();
 
-    void sendEOP(const std::string& path);
+    bool sendEOP(const std::string& path, const std::string& digest = "", std::uint32_t seq = 0, std::uint32_t stream = 0);
 
     void probe();
 
@@ -46,18 +46,19 @@ bool Message::getDataAvailable() const{
 /**
  * Default constructor for empty messages
  */
-Message::Message(): msgLen(0), dataHash(""), filePath(""), dataAvailable(false), opcode(null) {
+Message::Message(): msgLen(0), dataHash(""), filePath(""), dataAvailable(false), opcode(null), seq(0), stream(0) {
 }
 
 /**
- * Message constructor with parameters. Automatic computation of SHA3-256 digest of the data passed
+ * Message constructor with parameters. Automatic computation of SHA3-256 digest (or CRC32C checksum) of the data passed
  * @param opc - opcode of the message
  * @param path - path of the entry or username on login type messages
  * @param data - data chunk of the file pointed by path (if any) or password on login messages (discarded after digest computation)
+ * @param type - integrity check to be computed on data
  */
-Message::Message(Action opc, std::string path, std::vector<char>  data): dataAvailable(true), filePath(std::move(path)), fileData(std::move(data)), opcode(opc), msgLen(0) {
+Message::Message(Action opc, std::string path, std::vector<char>  data, Checksum type): dataAvailable(true), filePath(std::move(path)), fileData(std::move(data)), opcode(opc), msgLen(0), seq(0), stream(0) {
     std::replace( filePath.begin(), filePath.end(), '\\', '/');
-    dataHash=computeHash(fileData);
+    dataHash=(type==Checksum::crc32c && opcode!=login) ? computeChecksum(fileData) : computeHash(fileData);
 
     if (dataHash.empty()) {
         std::cout << "Digest computation problem!\n" << std::endl;
@@ -77,15 +78,168 @@ Message::Message(Action opc, std::string path, std::vector<char>  data): dataAva
  * @param opc - opcode of the message
  * @param path - path of the entry
  */
-Message::Message(Action opc, std::string path): msgLen(0), dataHash(""), filePath(std::move(path)), dataAvailable(false), opcode(opc) {
+Message::Message(Action opc, std::string path): msgLen(0), dataHash(""), filePath(std::move(path)), dataAvailable(false), opcode(opc), seq(0), stream(0) {
     std::replace( filePath.begin(), filePath.end(), '\\', '/');
 }
 
+/*
+ * Helpers of the JSON codec. The codec only deals with flat objects made of
+ * string (or number/literal) values, which is all a Message needs, and works
+ * directly on the wire buffer.
+ */
+namespace {
+
+    void skipSpaces(const char*& p, const char* end) {
+        while(p<end && (*p==' ' || *p=='\n' || *p=='\r' || *p=='\t'))
+            p++;
+    }
+
+    /*
+     * Scans the value starting at p (a string or a bare token): on success p points
+     * after it, [begin,stop) is its raw content and escaped is true if it contains
+     * escape sequences
+     */
+    bool scanValue(const char*& p, const char* end, const char*& begin, const char*& stop, bool& escaped) {
+        escaped=false;
+        if(p<end && *p=='"'){
+            begin=++p;
+            // Fast path for the common case of values without escape sequences
+            auto quote=(const char*)std::memchr(p, '"', end-p);
+            if(quote && !std::memchr(p, '\\', quote-p)){
+                stop=quote;
+                p=quote+1;
+                return true;
+            }
+            while(p<end && *p!='"'){
+                if(*p=='\\'){
+                    escaped=true;
+                    p++;
+                }
+                p++;
+            }
+            if(p>=end)
+                return false;
+            stop=p++;
+            return true;
+        }
+        begin=p;
+        while(p<end && *p!=',' && *p!='}' && *p!=' ' && *p!='\n' && *p!='\r' && *p!='\t'){
+            if(*p=='{' || *p=='[' || *p=='"')
+                return false;
+            p++;
+        }
+        stop=p;
+        return stop>begin;
+    }
+
+    void appendUTF8(std::string& out, unsigned long cp) {
+        if(cp<0x80)
+            out.push_back(char(cp));
+        else if(cp<0x800){
+            out.push_back(char(0xC0 | (cp>>6)));
+            out.push_back(char(0x80 | (cp & 0x3F)));
+        } else if(cp<0x10000){
+            out.push_back(char(0xE0 | (cp>>12)));
+            out.push_back(char(0x80 | ((cp>>6) & 0x3F)));
+            out.push_back(char(0x80 | (cp & 0x3F)));
+        } else{
+            out.push_back(char(0xF0 | (cp>>18)));
+            out.push_back(char(0x80 | ((cp>>12) & 0x3F)));
+            out.push_back(char(0x80 | ((cp>>6) & 0x3F)));
+            out.push_back(char(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    bool readHex4(const char*& p, const char* stop, unsigned long& cp) {
+        if(stop-p<4)
+            return false;
+        auto res=std::from_chars(p, p+4, cp, 16);
+        if(res.ptr!=p+4)
+            return false;
+        p+=4;
+        return true;
+    }
+
+    /*
+     * Assigns the unescaped content of a raw JSON string to out
+     * (\uXXXX sequences are converted to UTF-8 as JSON readers do)
+     */
+    bool unescape(const char* p, const char* stop, std::string& out) {
+        out.clear();
+        out.reserve(stop-p);
+        while(p<stop){
+            const char* run=p;
+            while(p<stop && *p!='\\')
+                p++;
+            out.append(run, p-run);
+            if(p==stop)
+                break;
+            if(++p==stop)
+                return false;
+            switch(*p++){
+                case '"': out.push_back('"'); break;
+                case '\\': out.push_back('\\'); break;
+                case '/': out.push_back('/'); break;
+                case 'b': out.push_back('\b'); break;
+                case 'f': out.push_back('\f'); break;
+                case 'n': out.push_back('\n'); break;
+                case 'r': out.push_back('\r'); break;
+                case 't': out.push_back('\t'); break;
+                case 'u': {
+                    unsigned long cp, low;
+                    if(!readHex4(p, stop, cp))
+                        return false;
+                    // Surrogate pair
+                    if(cp>=0xD800 && cp<0xDC00 && stop-p>=6 && p[0]=='\\' && p[1]=='u'){
+                        p+=2;
+                        if(!readHex4(p, stop, low) || low<0xDC00 || low>0xDFFF)
+                            return false;
+                        cp=0x10000+((cp-0xD800)<<10)+(low-0xDC00);
+                    }
+                    appendUTF8(out, cp);
+                    break;
+                }
+                default: return false;
+            }
+        }
+        return true;
+    }
+
+    void appendU32(std::string& out, std::uint32_t value) {
+        for(int shift=24; shift>=0; shift-=8)
+            out.push_back(char((value>>shift) & 0xFF));
+    }
+
+    std::uint32_t readU32(const unsigned char* bytes) {
+        return (std::uint32_t(bytes[0])<<24) | (std::uint32_t(bytes[1])<<16) | (std::uint32_t(bytes[2])<<8) | bytes[3];
+    }
+
+    void appendEscaped(std::string& out, const std::string& str) {
+        static const char digits[]="0123456789ABCDEF";
+        for(char c : str){
+            switch(c){
+                case '"': out.append("\\\""); break;
+                case '\\': out.append("\\\\"); break;
+                case '\b': out.append("\\b"); break;
+                case '\f': out.append("\\f"); break;
+                case '\n': out.append("\\n"); break;
+                case '\r': out.append("\\r"); break;
+                case '\t': out.append("\\t"); break;
+                default:
+                    if((unsigned char)c<0x20){
+                        out.append("\\u00");
+                        out.push_back(digits[(unsigned char)c>>4]);
+                        out.push_back(digits[c & 0x0F]);
+                    } else
+                        out.push_back(c);
+            }
+        }
+    }
+}
+
 /**
  * @return json representation of the message or<br>
- * &nbsp&nbsp&nbsp&nbsp "JSON Error" if json parsing fails <br>
- * &nbsp&nbsp&nbsp&nbsp "Data Error" if property tree field conversion fails <br>
- * &nbsp&nbsp&nbsp&nbsp "Base64 Error" if the base64 encoding of the data chunk fails
+ * &nbsp&nbsp&nbsp&nbsp "Data Error" if the message is too long for the length prefix
  */
  /*
   * We preferred to always send all fields even if they are null
@@ -98,38 +252,39 @@ Message::Message(Action opc, std::string path): msgLen(0), dataHash(""), filePat
   * Another possible approach could be a precise case-wise field read
   * but then the code would be very messy with no such appreciable benefit.
   *
-  * https://www.boost.org/doc/libs/1_74_0/doc/html/property_tree/synopsis.html
-  * https://www.boost.org/doc/libs/1_75_0/doc/html/property_tree/accessing.html
+  * The JSON is written straight after a placeholder of the length prefix in a single
+  * preallocated string, with the same layout used by boost::property_tree::write_json
+  * (every value is a string) so that it can be read by any JSON parser.
   */
 std::string Message::getJSON() {
-    try {
-        std::stringstream jsonstream,lenstream;
-        std::string jsonstring="";
-        boost::property_tree::ptree pt;
-        pt.put("Opcode", int(opcode));
-        pt.put("Path", filePath.c_str());
-        pt.put("Hash", dataHash.c_str());
-        if(dataAvailable)
-            pt.put("Data", base64_encode((unsigned char*)fileData.data(), fileData.size()));
-        else
-            pt.put("Data", "");
-        boost::property_tree::json_parser::write_json(jsonstream, pt);
-        msgLen=jsonstream.str().size();
-        lenstream<<std::setfill(' ')<<std::setw(MAX_MSG_LEN)<<msgLen;
-        jsonstring.append(lenstream.str());
-        jsonstring.append(jsonstream.str());
-        return jsonstring;
-
-    } catch (const boost::property_tree::json_parser_error& exc) {
-        std::cout<<"JSON parsing error on file: "<<filePath<<std::endl;
-        return "JSON Error";
-    } catch (const boost::property_tree::ptree_bad_data& exc) {
-        std::cout<<"Ptree field conversion error on file: "<<filePath<<std::endl;
+    std::size_t dataLen=dataAvailable ? fileData.size() : 0;
+    std::string json;
+    json.reserve(MAX_MSG_LEN + 80 + 2*filePath.size() + dataHash.size() + (dataLen+2)/3*4);
+
+    json.append(MAX_MSG_LEN, ' ');
+    json.append("{\n    \"Opcode\": \"");
+    json.append(std::to_string(int(opcode)));
+    json.append("\",\n    \"Seq\": \"");
+    json.append(std::to_string(seq));
+    json.append("\",\n    \"Stream\": \"");
+    json.append(std::to_string(stream));
+    json.append("\",\n    \"Path\": \"");
+    appendEscaped(json, filePath);
+    json.append("\",\n    \"Hash\": \"");
+    appendEscaped(json, dataHash);
+    json.append("\",\n    \"Data\": \"");
+    base64_encode((const unsigned char*)fileData.data(), dataLen, json);
+    json.append("\"\n}\n");
+
+    msgLen=json.size()-MAX_MSG_LEN;
+    std::string len=std::to_string(msgLen);
+    if(len.size()>MAX_MSG_LEN){
+        std::cout<<"Message too long on file: "<<filePath<<std::endl;
         return "Data Error";
-    } catch (const std::runtime_error& exc){
-        std::cout<<"Base64 encoding error on file :"<<filePath<<std::endl;
-        return "Base64 Error";
     }
+    json.replace(MAX_MSG_LEN-len.size(), len.size(), len);
+
+    return json;
 }
 
 /**
@@ -137,69 +292,384 @@ std::string Message::getJSON() {
  * @param jsonVect - std::vector<char> containing the JSON string to be parsed
  * @return 0 on success<br>
  * &nbsp&nbsp&nbsp&nbsp -1 in case of parsing error<br>
- * &nbsp&nbsp&nbsp&nbsp -2 if property tree field conversion fails <br>
- * &nbsp&nbsp&nbsp&nbsp -3 if property tree field path is incorrect <br>
+ * &nbsp&nbsp&nbsp&nbsp -2 if the opcode field is not a number <br>
+ * &nbsp&nbsp&nbsp&nbsp -3 if a field is missing <br>
  * &nbsp&nbsp&nbsp&nbsp -4 if the base64 encoding of the data chunk fails
  *
  */
+ /*
+  * The parser walks the receive buffer once: path and hash are assigned straight
+  * from it and the data is Base64 decoded from it into fileData. Only values
+  * containing escape sequences (e.g. "\/" written by boost::property_tree) are
+  * unescaped in a temporary string first. Unknown fields are skipped.
+  */
 int Message::parseJSON(const std::vector<char>& jsonVect) {
-    try{
-        boost::property_tree::ptree pt;
-        std::stringstream sstream(std::string(jsonVect.begin(),jsonVect.end()));
-        std::string datatmp;
-        int optmp;
-
-        boost::property_tree::json_parser::read_json(sstream,pt);
-        msgLen=jsonVect.size();
-        filePath=pt.get<std::string>("Path");
-        dataHash=pt.get<std::string>("Hash");
-
-        datatmp=pt.get<std::string>("Data");
-        if(datatmp.empty()){
-            fileData.clear();
-            fileData.reserve(0);
-        } else{
-            datatmp=base64_decode(datatmp);
-            fileData.reserve(datatmp.length());
-            fileData.assign(datatmp.begin(),datatmp.end());
-            fileData.shrink_to_fit();
+    const char* p=jsonVect.data();
+    const char* end=p+jsonVect.size();
+    const char *keyBegin, *keyStop, *begin, *stop, *opBegin=nullptr, *opStop=nullptr, *seqBegin=nullptr, *seqStop=nullptr, *streamBegin=nullptr, *streamStop=nullptr;
+    bool escaped, found[4]={false, false, false, false};
+    std::string key, tmp;
+
+    skipSpaces(p, end);
+    if(p==end || *p++!='{'){
+        std::cout<<"JSON parsing error"<<std::endl;
+        return -1;
+    }
+    skipSpaces(p, end);
+    while(p<end && *p!='}'){
+        if(*p!='"' || !scanValue(p, end, keyBegin, keyStop, escaped)){
+            std::cout<<"JSON parsing error"<<std::endl;
+            return -1;
+        }
+        if(escaped){
+            if(!unescape(keyBegin, keyStop, key)){
+                std::cout<<"JSON parsing error"<<std::endl;
+                return -1;
+            }
+        } else
+            key.assign(keyBegin, keyStop);
+
+        skipSpaces(p, end);
+        if(p==end || *p++!=':'){
+            std::cout<<"JSON parsing error"<<std::endl;
+            return -1;
         }
-        dataAvailable= !datatmp.empty();
-
-        optmp=pt.get<int>("Opcode");
-
-        switch(optmp){
-            case 101: opcode=create_file; break;
-            case 102: opcode=create_dir; break;
-            case 103: opcode=rename_file; break;
-            case 104: opcode=rename_dir; break;
-            case 105: opcode=remove_entry; break;
-            case 106: opcode=login; break;
-            case 107: opcode=check_file; break;
-            case 108: opcode=ping; break;
-            case 109: opcode=check_dir; break;
-            case 110: opcode=start_probe; break;
-            case 199: opcode=eop; break;
-            case 200: opcode=ok; break;
-            case 400: opcode=error; break;
-            default: opcode=null; break;
+        skipSpaces(p, end);
+        if(!scanValue(p, end, begin, stop, escaped)){
+            std::cout<<"JSON parsing error"<<std::endl;
+            return -1;
         }
 
-        return 0;
+        bool valid=true;
+        if(key=="Opcode"){
+            opBegin=begin;
+            opStop=stop;
+            found[0]=true;
+        } else if(key=="Seq"){
+            seqBegin=begin;
+            seqStop=stop;
+        } else if(key=="Stream"){
+            streamBegin=begin;
+            streamStop=stop;
+        } else if(key=="Path"){
+            valid=escaped ? unescape(begin, stop, filePath) : (filePath.assign(begin, stop), true);
+            found[1]=true;
+        } else if(key=="Hash"){
+            valid=escaped ? unescape(begin, stop, dataHash) : (dataHash.assign(begin, stop), true);
+            found[2]=true;
+        } else if(key=="Data"){
+            try{
+                if(escaped){
+                    valid=unescape(begin, stop, tmp);
+                    base64_decode(std::string_view(tmp), fileData);
+                } else
+                    base64_decode(std::string_view(begin, stop-begin), fileData);
+            } catch (const std::runtime_error& exc){
+                std::cout<<"Base64 decoding error"<<std::endl;
+                return -4;
+            }
+            found[3]=true;
+        }
+        if(!valid){
+            std::cout<<"JSON parsing error"<<std::endl;
+            return -1;
+        }
 
-    }catch (const boost::property_tree::json_parser_error& exc) {
+        skipSpaces(p, end);
+        if(p<end && *p==','){
+            p++;
+            skipSpaces(p, end);
+        } else if(p==end || *p!='}'){
+            std::cout<<"JSON parsing error"<<std::endl;
+            return -1;
+        }
+    }
+    if(p==end){
         std::cout<<"JSON parsing error"<<std::endl;
         return -1;
-    } catch (const boost::property_tree::ptree_bad_data& exc) {
-        std::cout<<"Ptree field conversion error"<<std::endl;
-        return -2;
-    } catch (const boost::property_tree::ptree_bad_path& exc) {
-        std::cout<<"Ptree field path error"<<std::endl;
+    }
+
+    if(!found[0] || !found[1] || !found[2] || !found[3]){
+        std::cout<<"JSON field path error"<<std::endl;
         return -3;
-    } catch (const std::runtime_error& exc){
-        std::cout<<"Base64 decoding error"<<std::endl;
-        return -4;
     }
+
+    int optmp;
+    auto res=std::from_chars(opBegin, opStop, optmp);
+    if(res.ec!=std::errc() || res.ptr!=opStop){
+        std::cout<<"JSON field conversion error"<<std::endl;
+        return -2;
+    }
+    // Seq is optional, messages without it are not part of a pipeline
+    seq=0;
+    if(seqBegin){
+        res=std::from_chars(seqBegin, seqStop, seq);
+        if(res.ec!=std::errc() || res.ptr!=seqStop){
+            std::cout<<"JSON field conversion error"<<std::endl;
+            return -2;
+        }
+    }
+    // Stream is optional as well, 0 is the serial transfer
+    stream=0;
+    if(streamBegin){
+        res=std::from_chars(streamBegin, streamStop, stream);
+        if(res.ec!=std::errc() || res.ptr!=streamStop){
+            std::cout<<"JSON field conversion error"<<std::endl;
+            return -2;
+        }
+    }
+
+    msgLen=jsonVect.size();
+    dataAvailable=!fileData.empty();
+    opcode=toAction(optmp);
+
+    return 0;
+}
+
+/**
+ * @return binary frame of the message (see Message.h for the header layout) or<br>
+ * &nbsp&nbsp&nbsp&nbsp "Data Error" if path, hash or data don't fit in the header fields
+ */
+std::string Message::getBinary() {
+    unsigned char hash[MAX_HASH_LEN]={0};
+    std::size_t hashLen=0;
+    std::size_t dataLen=dataAvailable ? fileData.size() : 0;
+
+    if(filePath.size()>UINT16_MAX || dataLen>UINT32_MAX || !hexToBytes(dataHash, hash, MAX_HASH_LEN, hashLen)){
+        std::cout<<"Binary framing error on file: "<<filePath<<std::endl;
+        return "Data Error";
+    }
+
+    std::string frame;
+    frame.reserve(BIN_HEADER_LEN+filePath.size()+dataLen);
+    frame.push_back(char(BIN_MAGIC));
+    frame.push_back(char(dataAvailable ? BIN_FLAG_DATA : 0));
+    frame.push_back(char((opcode>>8) & 0xFF));
+    frame.push_back(char(opcode & 0xFF));
+    frame.push_back(char((filePath.size()>>8) & 0xFF));
+    frame.push_back(char(filePath.size() & 0xFF));
+    frame.push_back(char(hashLen));
+    frame.push_back(0);
+    appendU32(frame, std::uint32_t(dataLen));
+    appendU32(frame, seq);
+    appendU32(frame, stream);
+    frame.append((const char*)hash, MAX_HASH_LEN);
+    frame.append(filePath);
+    frame.append(fileData.data(), dataLen);
+
+    msgLen=frame.size();
+    return frame;
+}
+
+/**
+ * Fills the Message object with fields from the provided binary frame
+ * @param frame - std::vector<char> containing the whole frame (header included)
+ * @return 0 on success<br>
+ * &nbsp&nbsp&nbsp&nbsp -1 if the frame is malformed
+ */
+int Message::parseBinary(const std::vector<char>& frame) {
+    if(frame.size()<BIN_HEADER_LEN || !isBinaryFrame(frame)){
+        std::cout<<"Binary frame error"<<std::endl;
+        return -1;
+    }
+
+    auto header=(const unsigned char*)frame.data();
+    std::size_t pathLen=(std::size_t(header[4])<<8) | header[5];
+    std::size_t hashLen=header[6];
+    std::size_t bodyLen=getBinaryBodyLen(frame);
+    if(hashLen>MAX_HASH_LEN || frame.size()!=BIN_HEADER_LEN+bodyLen){
+        std::cout<<"Binary frame error"<<std::endl;
+        return -1;
+    }
+
+    msgLen=frame.size();
+    opcode=toAction((int(header[2])<<8) | header[3]);
+    seq=readU32(header+12);
+    stream=readU32(header+16);
+    dataHash=bytesToHex(header+20, hashLen);
+    filePath.assign(frame.data()+BIN_HEADER_LEN, pathLen);
+    fileData.assign(frame.begin()+BIN_HEADER_LEN+pathLen, frame.end());
+    dataAvailable=(header[1] & BIN_FLAG_DATA) && !fileData.empty();
+
+    return 0;
+}
+
+/**
+ * @param binary - true for a binary frame, false for the JSON representation
+ * @return the message ready to be written on the socket
+ */
+std::string Message::getFrame(bool binary) {
+    return binary ? getBinary() : getJSON();
+}
+
+/**
+ * @param prefix - first (at least one) bytes received for a message
+ * @return true if the message is a binary frame, false if it is a JSON one
+ */
+bool Message::isBinaryFrame(const std::vector<char>& prefix) {
+    return !prefix.empty() && (unsigned char)prefix[0]==BIN_MAGIC;
+}
+
+/**
+ * @param header - at least BIN_HEADER_LEN bytes of a binary frame
+ * @return number of bytes (path and payload) following the header
+ */
+std::size_t Message::getBinaryBodyLen(const std::vector<char>& header) {
+    auto h=(const unsigned char*)header.data();
+    std::size_t pathLen=(std::size_t(h[4])<<8) | h[5];
+    std::size_t dataLen=readU32(h+8);
+    return pathLen+dataLen;
+}
+
+/**
+ * @param chunkSize - negotiated chunk size of the session
+ * @return maximum length of a message (after the length prefix) carrying a chunk of chunkSize bytes
+ */
+ /*
+  * The Base64 representation is doubled because JSON writers may escape every '/' of it
+  */
+std::size_t Message::getMaxFrameLen(std::size_t chunkSize) {
+    return 2*((chunkSize+2)/3*4) + MAX_FRAME_OVERHEAD;
+}
+
+/**
+ * @param opc - numeric opcode received from the socket
+ * @return the corresponding Action, null if unknown
+ */
+Action Message::toAction(int opc) {
+    switch(opc){
+        case 101: return create_file;
+        case 102: return create_dir;
+        case 103: return rename_file;
+        case 104: return rename_dir;
+        case 105: return remove_entry;
+        case 106: return login;
+        case 107: return check_file;
+        case 108: return ping;
+        case 109: return check_dir;
+        case 110: return start_probe;
+        case 111: return set_chunk;
+        case 112: return check_batch;
+        case 113: return check_tree;
+        case 114: return have_content;
+        case 115: return get_signature;
+        case 116: return put_delta;
+        case 117: return check_chunks;
+        case 118: return put_chunks;
+        case 199: return eop;
+        case 200: return ok;
+        case 400: return error;
+        default: return null;
+    }
+}
+
+/**
+ * @param path - path of the entry to be checked
+ * @param hash - hex digest of the file (empty for directories)
+ * @return number of bytes taken by the entry in a check_batch message
+ */
+std::size_t Message::getCheckEntryLen(const std::string& path, const std::string& hash) {
+    return 3+path.size()+hash.size()/2;
+}
+
+/**
+ * Append an entry to the data of a check_batch message
+ * @param batch - data of the message
+ * @param path - path of the entry to be checked
+ * @param hash - hex digest of the file (empty for directories)
+ * @return true on success, false if path or hash don't fit in the entry fields
+ */
+bool Message::appendCheckEntry(std::vector<char>& batch, const std::string& path, const std::string& hash) {
+    unsigned char raw[MAX_HASH_LEN];
+    std::size_t hashLen=0;
+
+    if(path.size()>UINT16_MAX || !hexToBytes(hash, raw, MAX_HASH_LEN, hashLen))
+        return false;
+
+    batch.push_back(char((path.size()>>8) & 0xFF));
+    batch.push_back(char(path.size() & 0xFF));
+    batch.push_back(char(hashLen));
+    batch.insert(batch.end(), path.begin(), path.end());
+    batch.insert(batch.end(), raw, raw+hashLen);
+    return true;
+}
+
+/**
+ * Read the next entry from the data of a check_batch message
+ * @param batch - data of the message
+ * @param offset - position of the entry, moved to the next one
+ * @param path - path of the entry to be checked
+ * @param hash - hex digest of the file (empty for directories)
+ * @return true on success, false if the entry is truncated
+ */
+bool Message::readCheckEntry(const std::vector<char>& batch, std::size_t& offset, std::string& path, std::string& hash) {
+    if(batch.size()-offset<3)
+        return false;
+
+    auto entry=(const unsigned char*)batch.data()+offset;
+    std::size_t pathLen=(std::size_t(entry[0])<<8) | entry[1];
+    std::size_t hashLen=entry[2];
+    if(hashLen>MAX_HASH_LEN || batch.size()-offset-3<pathLen+hashLen)
+        return false;
+
+    path.assign((const char*)entry+3, pathLen);
+    hash=bytesToHex(entry+3+pathLen, hashLen);
+    offset+=3+pathLen+hashLen;
+    return true;
+}
+
+/**
+ * Append a number to the data of a message (network byte order)
+ * @param data - data of the message
+ * @param value - number to be appended
+ */
+void Message::putUint32(std::vector<char>& data, std::uint32_t value) {
+    for(int shift=24; shift>=0; shift-=8)
+        data.push_back(char((value>>shift) & 0xFF));
+}
+
+/**
+ * Read a number from the data of a message (network byte order)
+ * @param data - data of the message
+ * @param offset - position of the number, moved after it
+ * @param value - number read
+ * @return true on success, false if the data is truncated
+ */
+bool Message::getUint32(const std::vector<char>& data, std::size_t& offset, std::uint32_t& value) {
+    if(offset>data.size() || data.size()-offset<4)
+        return false;
+
+    value=readU32((const unsigned char*)data.data()+offset);
+    offset+=4;
+    return true;
+}
+
+/**
+ * Append the signature of a block to the data of the ack of a get_signature message
+ * @param signature - data of the ack
+ * @param weak - rolling checksum of the block
+ * @param strong - raw strong checksum of the block (BLOCK_DIGEST_LEN bytes)
+ */
+void Message::appendBlockSignature(std::vector<char>& signature, std::uint32_t weak, const std::string& strong) {
+    putUint32(signature, weak);
+    signature.insert(signature.end(), strong.begin(), strong.end());
+}
+
+/**
+ * Read the signature of the next block from the data of the ack of a get_signature message
+ * @param signature - data of the ack
+ * @param offset - position of the block signature, moved to the next one
+ * @param weak - rolling checksum of the block
+ * @param strong - raw strong checksum of the block
+ * @return true on success, false if there are no more blocks
+ */
+bool Message::readBlockSignature(const std::vector<char>& signature, std::size_t& offset, std::uint32_t& weak, std::string& strong) {
+    if(offset>signature.size() || signature.size()-offset<4+BLOCK_DIGEST_LEN || !getUint32(signature, offset, weak))
+        return false;
+
+    strong.assign(signature.data()+offset, BLOCK_DIGEST_LEN);
+    offset+=BLOCK_DIGEST_LEN;
+    return true;
 }
 
 /**
@@ -232,6 +702,53 @@ void Message::setFileData(std::vector<char> data) {
 
 }
 
+/**
+ * @return sequence number of the operation the message belongs to (0 if none)
+ */
+std::uint32_t Message::getSeq() const {
+    return seq;
+}
+
+/**
+ * Set the sequence number of the operation the message belongs to
+ * @param s - sequence number
+ */
+void Message::setSeq(std::uint32_t s) {
+    seq = s;
+}
+
+/**
+ * @return ID of the multiplexed upload the message belongs to (0 for the serial transfer)
+ */
+std::uint32_t Message::getStream() const {
+    return stream;
+}
+
+/**
+ * Set the ID of the multiplexed upload the message belongs to
+ * @param s - stream ID
+ */
+void Message::setStream(std::uint32_t s) {
+    stream = s;
+}
+
+/**
+ * Set the hash field, e.g. the digest of a whole file on eop messages
+ * @param hash - hex representation of the digest
+ */
+void Message::setDataHash(std::string hash) {
+    dataHash = std::move(hash);
+}
+
+/**
+ * @return true if the hash field matches the data (CRC32C or SHA3-256, depending on the hash length)
+ */
+bool Message::checkData() const {
+    if(dataHash.size()==2*CRC32C_LEN)
+        return computeChecksum(fileData)==dataHash;
+    return computeHash(fileData)==dataHash;
+}
+
 /**
  * Set the opcode of the message
  * @param opc - Action enum of the opcode
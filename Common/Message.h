@@ -3,7 +3,10 @@
  * the smallest maximum path length (with no particular configurations)
  * between Windows and Linux systems
  *
- * The maximum body length is set to 1024 Bytes which seems a reasonably size.
+ * The default body length is set to 1024 Bytes which seems a reasonably size,
+ * a larger one (up to MAX_CHUNK_LEN) can be negotiated per session with a
+ * set_chunk message carrying the requested size as path: the server replies
+ * with an ok message carrying the accepted size as path.
  *
  * http://pages.cs.wisc.edu/~remzi/Classes/537/LectureNotes/Papers/windows-fs.pdf
  */
@@ -11,7 +14,7 @@
 /*
  * MAX_MSG_LEN is needed in order to know the exact (and fixed) number of digits
  * to read in every message in order to read and store it properly.
- * It is set to 4 digits and it is determined by:
+ * It is set to 8 digits and it is determined by:
  *  - Actual message length to be sent as first part of the message, fixed to
  *  - Max path length (decided as it is stated above)
  *  - Max body length that is the maximum amount of data that can be sent in a single message
@@ -20,10 +23,79 @@
  *  - JSON syntax
  *
  * The protocol is meant to send only the aforementioned fields and
- * at most 1024 bytes of body data per message to reduce both workload and
- * resources usage but since the message length will be always wrote/read
- * on 4 digits actually there is space for future modifications
- * and/or newer implementations and additions.
+ * at most the negotiated amount of body data per message: 8 digits are enough
+ * for the Base64 encoding of a MAX_CHUNK_LEN chunk plus the other fields.
+ */
+
+/*
+ * Every message carries a sequence number (0 if unused) which is echoed by the
+ * server in the ok/error ack of the operation, so that the client can keep more
+ * operations in flight and match their acks asynchronously. All the messages of
+ * a single operation (e.g. the chunks of a file and its eop) share the same one.
+ * In JSON messages it is the optional "Seq" field.
+ *
+ * Create_file and eop messages with a non zero stream ID belong to a multiplexed
+ * upload: the chunks of several files can be interleaved on the same connection,
+ * the server keeps an open file per stream and acknowledges the whole file on the
+ * eop of its stream only. Stream 0 is the serial transfer (the eop of stream 0
+ * also ends the phases of a probe). In JSON messages it is the optional "Stream" field.
+ */
+
+/*
+ * A check_batch message carries in its data many entries to be checked by the
+ * server during the probe, each one made of:
+ *  - path length (2 bytes, network byte order) and hash length (1 byte, 0 for directories)
+ *  - path and raw hash digest
+ * The ok ack carries in its data a bitmap with the bit i (LSB first) set if the
+ * entry i is stored on the server, so a whole tree is checked in a few round trips.
+ *
+ * A check_tree message has the same layout, with the Merkle tree hash of directories
+ * (see computeTreeHash) as hash and the directory path relative to the root ("" for
+ * the root itself): a set bit means the whole subtree is the same on the server, so
+ * the probe only descends into the directories that differ.
+ *
+ * A have_content message asks the server to create the file in its path from a
+ * stored file with the digest in its hash field: on ok the file is created without
+ * uploading it, on error the client uploads it.
+ *
+ * A get_signature message asks the server for the block signatures of its copy of
+ * a file, sent in the data of the ok ack: the block size (4 bytes, network byte order)
+ * followed, for every block, by its rolling checksum (4 bytes, see computeRollingChecksum)
+ * and its strong checksum (BLOCK_DIGEST_LEN bytes, see computeBlockDigest).
+ * The file is then sent as a stream of put_delta messages (like the create_file chunks)
+ * whose data is the block size followed by runs of:
+ *  - 'C', first block and number of blocks (4 bytes each): blocks of the server copy
+ *  - 'L' and length (4 bytes) followed by the literal bytes
+ * The server rebuilds the file from its copy and the literal runs, the eop of the stream
+ * carries the digest of the whole file.
+ *
+ * With the chunk store (CHUNK_STORE) a file is split in content-defined chunks (see
+ * findChunkBoundary) and a check_chunks message carries the raw SHA3-256 digests of
+ * some of them: the ok ack carries a bitmap (like check_batch) with the bit i set if
+ * the chunk i is already stored on the server. A file whose chunks are checked with
+ * more messages (same sequence number) gets an ack for each one, in order.
+ * The file is then sent as a stream of put_chunks messages whose data is made of the
+ * chunks in order, each one as:
+ *  - 'R', raw digest and length (4 bytes): a chunk stored on the server
+ *  - 'D', raw digest and length (4 bytes) followed by the bytes of the chunk
+ * and the eop of the stream carries the digest of the whole file.
+ */
+
+/*
+ * Binary frames are an alternative to the JSON representation: they start with
+ * BIN_MAGIC (which can never be the first character of the JSON length prefix)
+ * so that the receiver can detect the format from the first MAX_MSG_LEN bytes.
+ * The fixed header (all fields in network byte order) is made of:
+ *  - magic byte (1 byte)
+ *  - flags (1 byte), BIN_FLAG_DATA is set if the data vector is filled
+ *  - opcode (2 bytes)
+ *  - path length (2 bytes)
+ *  - hash length (1 byte) and a reserved byte
+ *  - payload length (4 bytes)
+ *  - sequence number (4 bytes)
+ *  - stream ID (4 bytes)
+ *  - raw hash digest (MAX_HASH_LEN bytes, zero padded)
+ * and it is followed by the path and the raw (not encoded) payload bytes.
  */
 
 #pragma once
@@ -31,22 +103,34 @@
 #include <iostream>
 #include <stdexcept>
 #include <algorithm>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
-#include <boost/property_tree/exceptions.hpp>
+#include <charconv>
+#include <cstring>
 #include "../Utilities/Utilities.h"
 #include "../Utilities/base64.h"
 
 
 
-#define MAX_MSG_LEN 4
+#define MAX_MSG_LEN 8
 #define MAX_PATH_LEN 260
 #define MAX_BODY_LEN 1024
+#define MAX_CHUNK_LEN (8*1024*1024)
+#define MAX_FRAME_OVERHEAD 4096
+
+#define BIN_MAGIC 0xB5
+#define BIN_HEADER_LEN 52
+#define BIN_FLAG_DATA 0x01
+#define MAX_HASH_LEN 32
+
+/**
+ * Integrity check carried in the hash field of data messages: a SHA3-256 digest
+ * or a (much cheaper) CRC32C checksum, told apart by their length
+ */
+enum class Checksum {sha3, crc32c};
 
 /**
  * eop=end of operation
  */
-enum Action{null=0, create_file=101, create_dir=102, rename_file=103, rename_dir=104, remove_entry=105, login=106, check_file=107, ping=108, check_dir=109, start_probe=110, eop=199, ok=200, error=400};
+enum Action{null=0, create_file=101, create_dir=102, rename_file=103, rename_dir=104, remove_entry=105, login=106, check_file=107, ping=108, check_dir=109, start_probe=110, set_chunk=111, check_batch=112, check_tree=113, have_content=114, get_signature=115, put_delta=116, check_chunks=117, put_chunks=118, eop=199, ok=200, error=400};
 
 class Message {
     std::size_t msgLen;
@@ -55,12 +139,14 @@ class Message {
     std::vector<char> fileData;
     bool dataAvailable;
     Action opcode;
+    std::uint32_t seq;
+    std::uint32_t stream;
 
 public:
 
     Message();
 
-    Message(Action opc, std::string path,std::vector<char>  data);
+    Message(Action opc, std::string path,std::vector<char>  data, Checksum type=Checksum::sha3);
 
     Message(Action opc, std::string path);
 
@@ -68,6 +154,34 @@ public:
 
     int parseJSON(const std::vector<char>& jsonVect);
 
+    std::string getBinary();
+
+    int parseBinary(const std::vector<char>& frame);
+
+    std::string getFrame(bool binary);
+
+    static bool isBinaryFrame(const std::vector<char>& prefix);
+
+    static std::size_t getBinaryBodyLen(const std::vector<char>& header);
+
+    static Action toAction(int opc);
+
+    static std::size_t getMaxFrameLen(std::size_t chunkSize);
+
+    static std::size_t getCheckEntryLen(const std::string& path, const std::string& hash);
+
+    static bool appendCheckEntry(std::vector<char>& batch, const std::string& path, const std::string& hash);
+
+    static bool readCheckEntry(const std::vector<char>& batch, std::size_t& offset, std::string& path, std::string& hash);
+
+    static void putUint32(std::vector<char>& data, std::uint32_t value);
+
+    static bool getUint32(const std::vector<char>& data, std::size_t& offset, std::uint32_t& value);
+
+    static void appendBlockSignature(std::vector<char>& signature, std::uint32_t weak, const std::string& strong);
+
+    static bool readBlockSignature(const std::vector<char>& signature, std::size_t& offset, std::uint32_t& weak, std::string& strong);
+
     size_t getMsgLen() const;
 
     const std::string &getDataHash() const;
@@ -82,8 +196,20 @@ public:
 
     void setFileData(std::vector<char> fileData);
 
+    void setDataHash(std::string hash);
+
+    bool checkData() const;
+
     void setOpcode(Action opc);
 
+    std::uint32_t getSeq() const;
+
+    void setSeq(std::uint32_t seq);
+
+    std::uint32_t getStream() const;
+
+    void setStream(std::uint32_t stream);
+
     bool getDataAvailable() const;
 
 };
@@ -7,11 +7,55 @@
 // Number of probe interval to wait before server closing
 #define INT_NUM 3
 
+// Number of probe intervals the periodic probe waits for the pending files at most (less than INT_NUM)
+#define PROBE_MAX_WAIT 2
+
 // Ip address of the server
 #define IP_SERVER "127.0.0.1"
 
 // Port number of the server
 #define PORT_NUM 3000
 
+// Wire format used by the client: true for binary frames, false for JSON (the server replies in the same format)
+#define BINARY_PROTOCOL true
+
+// Chunk size requested by the client after login (the server accepts at most MAX_CHUNK_LEN)
+#define CHUNK_SIZE (1024*1024)
+
+// Integrity check of the data chunks sent by the client (Checksum::crc32c or Checksum::sha3).
+// With CRC32C chunks the SHA3-256 digest of the whole file is sent with the eop message
+#define CHUNK_CHECKSUM Checksum::crc32c
+
+// Changes of the watched directory notified by inotify (Linux only) instead of polling the whole tree every DELAY
+#define INOTIFY_WATCHER true
+
+// Maximum number of operations sent by the client without having received their acks
+#define WINDOW_SIZE 32
+
+// Number of times an operation refused by the server is sent again before waiting for the next probe
+#define MAX_RETRY 3
+
+// Maximum number of file uploads interleaved on the same connection
+#define MAX_STREAMS 8
+
 // Path of the client configuration file
-#define CONF_FILE_CLIENT "../client.conf"
\ No newline at end of file
+#define CONF_FILE_CLIENT "../client.conf"
+
+// Path of the client cache of the file digests (by device and inode, valid while size and last write time are unchanged)
+#define HASH_CACHE_FILE "../hash.cache"
+
+// Files of at least this size are first looked up by digest on the server (have_content), smaller ones are just uploaded
+#define CONTENT_MATCH_SIZE (64*1024)
+
+// Modified files of at least this size are sent as a delta against the copy on the server
+#define DELTA_MIN_SIZE (1024*1024)
+
+// Files are stored on the server as chunk manifests, their content-defined chunks only once in a shared store,
+// and only the chunks the server lacks are uploaded
+#define CHUNK_STORE false
+
+// Quiet period: a changed file is sent once its size and last write time stay unchanged for this time (ms)
+#define SETTLE_TIME 1000
+
+// A file that never stops changing is sent anyway after this time (ms)
+#define SETTLE_MAX_TIME 30000
\ No newline at end of file
@@ -0,0 +1,268 @@
+#include "ChunkStore.h"
+#include "../Utilities/Utilities.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+// First line of a chunk manifest, followed by the digest and the length of the file
+#define MANIFEST_MAGIC "#chunks"
+
+/**
+ * Constructor
+ * @param dir directory of the chunks
+ * @param tempDir directory of the chunks being written (on the same filesystem)
+ * @param commits group commit moving the new chunks to the store
+ */
+ChunkStore::ChunkStore(std::string dir, std::string tempDir, GroupCommit& commits)
+        : dir(std::move(dir)), tempDir(std::move(tempDir)), commits(commits) {
+}
+
+/**
+ * Create the directories of the store (all of them, so that a new chunk never needs a new directory)
+ * @return true if success
+ */
+bool ChunkStore::init() {
+
+    static const char digits[] = "0123456789abcdef";
+    std::error_code err;
+    for (int i = 0; i < 256; i++) {
+        std::filesystem::create_directories(this->dir + digits[i >> 4] + digits[i & 0x0F], err);
+        if (err) {
+            std::cout << "Error on creating the chunk store: " << err.message() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @param digest hex digest of a chunk
+ * @return path of the chunk in the store
+ */
+std::string ChunkStore::chunkPath(const std::string& digest) const {
+    return this->dir + digest.substr(0, 2) + "/" + digest;
+}
+
+/**
+ * @param chunks lines of the chunks of a manifest (digest and length)
+ * @return paths of the chunks in the store
+ */
+std::vector<std::string> ChunkStore::chunkPaths(const std::string& chunks) const {
+
+    std::istringstream lines(chunks);
+    std::vector<std::string> paths;
+    std::string digest;
+    std::size_t len;
+    while (lines >> digest >> len)
+        if (digest.size() > 2)
+            paths.push_back(chunkPath(digest));
+    return paths;
+}
+
+/**
+ * @param digest hex digest of a chunk
+ * @return true if the chunk is stored (or it is being stored, the group commit moves it before the files of its batch)
+ */
+bool ChunkStore::has(const std::string& digest) const {
+
+    std::error_code err;
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        if (this->pending.count(digest))
+            return true;
+    }
+    return digest.size() > 2 && std::filesystem::exists(chunkPath(digest), err);
+}
+
+/**
+ * @param digest hex digest of a chunk
+ * @param len length of the chunk
+ * @return true if the chunk is stored (or being stored) with that length
+ */
+bool ChunkStore::has(const std::string& digest, std::size_t len) const {
+
+    std::error_code err;
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        auto it = this->pending.find(digest);
+        if (it != this->pending.end())
+            return it->second.second == len;
+    }
+    return digest.size() > 2 && std::filesystem::file_size(chunkPath(digest), err) == len && !err;
+}
+
+/**
+ * Store a chunk, unless it is already stored
+ * @param digest hex digest of the chunk (checked by the caller)
+ * @param data content of the chunk
+ * @param len length of the chunk
+ * @return true if success
+ */
+bool ChunkStore::put(const std::string& digest, const char* data, std::size_t len) {
+
+    // Written aside and moved by the group commit once durable, so that a chunk in the store is always complete
+    std::string tmpPath = this->tempDir + "c" + std::to_string(++this->counter);
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        std::error_code err;
+        if (this->pending.count(digest) || std::filesystem::file_size(chunkPath(digest), err) == len)
+            return true;
+        this->pending.emplace(digest, std::make_pair(tmpPath, len));
+    }
+
+    std::ofstream ofs(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    ofs.write(data, len);
+    ofs.close();
+    int fd = ofs.fail() ? -1 : open(tmpPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cout << "Error on writing chunk " << digest << ": " << strerror(errno) << std::endl;
+        std::error_code err;
+        std::filesystem::remove(tmpPath, err);
+        std::lock_guard<std::mutex> lock(this->m);
+        this->pending.erase(digest);
+        return false;
+    }
+    // Moved before the manifests committed in the same batch, which may refer to it
+    this->commits.commit(fd, tmpPath, chunkPath(digest), [this, digest](bool) {
+        std::lock_guard<std::mutex> lock(this->m);
+        this->pending.erase(digest);
+    }, true);
+    return true;
+}
+
+/**
+ * Compute the digest of the content of a file from its chunks, read from the store (or from tempDir,
+ * if they are still being stored). It doesn't trust the digests of the chunks: a chunk must have its length
+ * @param chunks lines of the chunks (digest and length), in order
+ * @return hex SHA3-256 digest of the content, empty string if a chunk is missing or malformed
+ */
+std::string ChunkStore::contentDigest(const std::string& chunks) const {
+
+    std::istringstream lines(chunks);
+    std::string digest;
+    std::size_t len;
+    std::vector<char> buf;
+    HashStream h;
+    while (lines >> digest >> len) {
+        std::string tmpPath;
+        {
+            std::lock_guard<std::mutex> lock(this->m);
+            auto it = this->pending.find(digest);
+            if (it != this->pending.end())
+                tmpPath = it->second.first;
+        }
+        // The chunk may have been moved to the store in the meantime
+        std::ifstream ifs;
+        if (!tmpPath.empty())
+            ifs.open(tmpPath, std::ios::in | std::ios::binary);
+        if (!ifs.is_open() && digest.size() > 2)
+            ifs.open(chunkPath(digest), std::ios::in | std::ios::binary);
+        buf.resize(len);
+        if (!ifs.is_open() || !ifs.read(buf.data(), len) || ifs.peek() != std::char_traits<char>::eof()) {
+            std::cout << "Missing chunk " << digest << std::endl;
+            return "";
+        }
+        h.update(buf.data(), len);
+    }
+    if (!lines.eof())
+        return "";
+    return h.final();
+}
+
+/**
+ * Write a chunk manifest
+ * @param path path of the manifest
+ * @param digest hex digest of the whole file
+ * @param size length of the whole file
+ * @param chunks lines of the chunks (digest and length)
+ * @return true if success
+ */
+bool ChunkStore::writeManifest(const std::string& path, const std::string& digest, std::uintmax_t size, const std::string& chunks) {
+
+    std::ofstream ofs(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    ofs << MANIFEST_MAGIC << " " << digest << " " << size << "\n" << chunks;
+    ofs.close();
+    if (ofs.fail()) {
+        std::cout << "Error on writing manifest " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read the header of a chunk manifest
+ * @param path path of the manifest
+ * @param digest hex digest of the whole file
+ * @param size length of the whole file
+ * @return true if success, false if the file isn't a chunk manifest
+ */
+bool ChunkStore::readHeader(const std::string& path, std::string& digest, std::uintmax_t& size) {
+
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    std::string line, magic;
+    if (!std::getline(ifs, line))
+        return false;
+    std::istringstream header(line);
+    return header >> magic >> digest >> size && magic == MANIFEST_MAGIC;
+}
+
+/**
+ * Read the chunks of a chunk manifest
+ * @param path path of the manifest
+ * @param chunks digests and lengths of the chunks, in order
+ * @return true if success, false if the file isn't a chunk manifest
+ */
+bool ChunkStore::readManifest(const std::string& path, std::vector<std::pair<std::string, std::uint32_t>>& chunks) {
+
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    std::string magic, digest;
+    std::uintmax_t size;
+    if (!(ifs >> magic >> digest >> size) || magic != MANIFEST_MAGIC)
+        return false;
+    std::uint32_t len;
+    while (ifs >> digest >> len)
+        chunks.emplace_back(digest, len);
+    return ifs.eof();
+}
+
+/**
+ * Delete the chunks no manifest refers to anymore (files removed or overwritten).
+ * It runs when the server starts, before any session can add chunks or refer to them
+ * @param root directory of the files of the users
+ */
+void ChunkStore::collect(const std::string& root) {
+
+    std::unordered_set<std::string> used;
+    std::vector<std::pair<std::string, std::uint32_t>> chunks;
+    std::error_code err;
+    std::filesystem::path chunkDir = std::filesystem::path(this->dir).lexically_normal();
+    std::filesystem::path tmpDir = std::filesystem::path(this->tempDir).lexically_normal();
+    for (auto it = std::filesystem::recursive_directory_iterator(root, err); !err && it != std::filesystem::recursive_directory_iterator(); it.increment(err)) {
+        std::filesystem::path p = it->path().lexically_normal();
+        if (it->is_directory(err)) {
+            if (p / "" == chunkDir || p / "" == tmpDir)
+                it.disable_recursion_pending();
+            continue;
+        }
+        chunks.clear();
+        if (it->is_regular_file(err) && readManifest(it->path().string(), chunks))
+            for (auto &c : chunks)
+                used.insert(c.first);
+    }
+    if (err) {
+        std::cout << "Error on reading the manifests, chunks not collected: " << err.message() << std::endl;
+        return;
+    }
+
+    std::size_t removed = 0;
+    for (auto it = std::filesystem::recursive_directory_iterator(this->dir, err); !err && it != std::filesystem::recursive_directory_iterator(); it.increment(err)) {
+        if (it->is_regular_file(err) && !used.count(it->path().filename().string()) && std::filesystem::remove(it->path(), err))
+            removed++;
+    }
+    std::cout << "Chunk store: " << used.size() << " chunks in use, " << removed << " removed" << std::endl;
+}
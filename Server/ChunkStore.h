@@ -0,0 +1,77 @@
+#pragma once
+
+#include "GroupCommit.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Content-addressed store of the chunks of the files of all the users (CHUNK_STORE): every chunk is stored once,
+ * in a file named by the hex SHA3-256 digest of its content (in a subdirectory given by its first two digits).
+ * A user file is stored as a chunk manifest: a header line with the digest and the length of the whole file,
+ * then a line with digest and length of every chunk, in order
+ */
+class ChunkStore {
+
+    /**
+     * Directory of the chunks
+     */
+    std::string dir;
+
+    /**
+     * Directory of the chunks being written, moved to the store when complete
+     */
+    std::string tempDir;
+
+    /**
+     * Group commit moving the new chunks to the store once durable
+     */
+    GroupCommit& commits;
+
+    /**
+     * Counter for the names of the chunks being written
+     */
+    std::atomic<std::uint64_t> counter{0};
+
+    /**
+     * Chunks written but not yet in the store (digest -> path in tempDir and length), shared by the sessions
+     */
+    std::unordered_map<std::string, std::pair<std::string, std::size_t>> pending;
+
+    /**
+     * Mutex of the pending chunks
+     */
+    mutable std::mutex m;
+
+public:
+
+    ChunkStore(std::string dir, std::string tempDir, GroupCommit& commits);
+
+    bool init();
+
+    std::string chunkPath(const std::string& digest) const;
+
+    std::vector<std::string> chunkPaths(const std::string& chunks) const;
+
+    bool has(const std::string& digest) const;
+
+    bool has(const std::string& digest, std::size_t len) const;
+
+    bool put(const std::string& digest, const char* data, std::size_t len);
+
+    std::string contentDigest(const std::string& chunks) const;
+
+    static bool writeManifest(const std::string& path, const std::string& digest, std::uintmax_t size, const std::string& chunks);
+
+    static bool readHeader(const std::string& path, std::string& digest, std::uintmax_t& size);
+
+    static bool readManifest(const std::string& path, std::vector<std::pair<std::string, std::uint32_t>>& chunks);
+
+    void collect(const std::string& root);
+
+};
@@ -0,0 +1,168 @@
+#include "GroupCommit.h"
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Attempts to flush a directory after the renames in it
+#define DIR_SYNC_ATTEMPTS 3
+
+/**
+ * Constructor, the thread of the group commit is started
+ * @param window time waited for other files after the first one of a batch (ms)
+ */
+GroupCommit::GroupCommit(unsigned window): window(window) {
+    this->worker = std::thread(&GroupCommit::run, this);
+}
+
+/**
+ * Destructor, the files still queued are flushed before the thread ends
+ */
+GroupCommit::~GroupCommit() {
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        this->stop = true;
+    }
+    this->cv.notify_one();
+    this->worker.join();
+}
+
+/**
+ * Queue a complete file to be made durable and moved to its place with the next batch
+ * @param fd file descriptor of the file, closed by the group commit
+ * @param tmpPath path of the file while it is written
+ * @param path place of the file, where it is moved once durable (the file at tmpPath is deleted on errors)
+ * @param done function called by the thread of the group commit with the result (it shouldn't block)
+ * @param first true if the file has to be in its place before the other files of its batch
+ * (e.g. a chunk, the manifests of the files refer to it)
+ * @param deps places of the files this one refers to: it fails if one of them fails in the same batch
+ */
+void GroupCommit::commit(int fd, std::string tmpPath, std::string path, std::function<void(bool)> done, bool first,
+                         std::vector<std::string> deps) {
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        this->queue.push_back(Pending{fd, std::move(tmpPath), std::move(path), std::move(done), first, std::move(deps)});
+    }
+    this->cv.notify_one();
+}
+
+/**
+ * Routine of the thread: collect the files committed within the window, flush them, move them
+ * to their place (in the order they were committed) and flush their parent directories,
+ * then notify the result for every file. A file is never in its place before its data is durable
+ */
+void GroupCommit::run() {
+
+    std::unique_lock<std::mutex> lock(this->m);
+    while (true) {
+        this->cv.wait(lock, [this] { return this->stop || !this->queue.empty(); });
+        if (this->queue.empty())
+            return;
+        if (!this->stop)
+            this->cv.wait_for(lock, std::chrono::milliseconds(this->window), [this] { return this->stop; });
+
+        std::vector<Pending> batch;
+        batch.swap(this->queue);
+        lock.unlock();
+
+        std::vector<bool> res(batch.size());
+        for (std::size_t i = 0; i < batch.size(); i++) {
+            res[i] = syncFd(batch[i].fd, batch[i].tmpPath);
+            if (batch[i].fd >= 0)
+                close(batch[i].fd);
+        }
+        place(batch, res, true);
+        // Only the files referring to the ones that failed fail with them
+        std::set<std::string> failed;
+        for (std::size_t i = 0; i < batch.size(); i++)
+            if (batch[i].first && !res[i])
+                failed.insert(batch[i].path);
+        for (std::size_t i = 0; i < batch.size() && !failed.empty(); i++)
+            for (auto &d : batch[i].deps)
+                if (!batch[i].first && failed.count(d))
+                    res[i] = false;
+        place(batch, res, false);
+        for (std::size_t i = 0; i < batch.size(); i++)
+            batch[i].done(res[i]);
+
+        lock.lock();
+    }
+}
+
+/**
+ * Move the flushed files of a batch to their place and flush their parent directories
+ * (the renames are durable once the directories are, a file fails only if it can't be moved)
+ * @param batch files of the batch
+ * @param res result of every file, updated (the file is deleted on errors)
+ * @param first true for the files that have to be in their place first, false for the others
+ */
+void GroupCommit::place(std::vector<Pending>& batch, std::vector<bool>& res, bool first) {
+
+    std::error_code err;
+    std::set<std::string> dirs;
+    for (std::size_t i = 0; i < batch.size(); i++) {
+        if (batch[i].first != first)
+            continue;
+        if (res[i]) {
+            std::filesystem::rename(batch[i].tmpPath, batch[i].path, err);
+            if (err) {
+                std::cout << "Error on moving " << batch[i].path << ": " << err.message() << std::endl;
+                res[i] = false;
+            }
+        }
+        if (!res[i]) {
+            std::filesystem::remove(std::filesystem::path(batch[i].tmpPath), err);
+            continue;
+        }
+        std::size_t pos = batch[i].path.rfind('/');
+        dirs.insert(pos == std::string::npos ? "." : batch[i].path.substr(0, pos));
+    }
+    // The files are in their place already: a directory that can't be flushed is retried, then reported,
+    // but its files are stored (their renames may be lost only if the system crashes)
+    for (auto &d : dirs) {
+        int attempt = 0;
+        while (!syncDir(d) && ++attempt < DIR_SYNC_ATTEMPTS)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (attempt == DIR_SYNC_ATTEMPTS)
+            std::cout << "Directory " << d << " not flushed, the renames in it may not be durable" << std::endl;
+    }
+}
+
+/**
+ * Flush a file to disk
+ * @param fd file descriptor of the file
+ * @param path path of the file (for the errors)
+ * @return true if success
+ */
+bool GroupCommit::syncFd(int fd, const std::string& path) {
+
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (!ok)
+        std::cout << "Error on syncing " << path << ": " << strerror(errno) << std::endl;
+    return ok;
+}
+
+/**
+ * Flush a directory to disk
+ * @param path path of the directory
+ * @return true if success (a directory removed in the meantime doesn't need to be flushed)
+ */
+bool GroupCommit::syncDir(const std::string& path) {
+
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return true;
+        std::cout << "Error on opening " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    if (!ok)
+        std::cout << "Error on syncing " << path << ": " << strerror(errno) << std::endl;
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+/**
+ * Group commit of the received files: the files committed by all the sessions within a window
+ * are made durable together by a single thread (fsync of every file, then the renames to their place,
+ * then fsync once for every parent directory), so that many small files don't pay one synchronous flush each
+ */
+class GroupCommit {
+
+    /**
+     * File waiting to be made durable and moved to its place, and function to be called when done
+     */
+    struct Pending {
+        int fd;
+        std::string tmpPath;
+        std::string path;
+        std::function<void(bool)> done;
+        bool first;
+        // Files of the batch that have to be in their place for this one (e.g. the chunks of a manifest)
+        std::vector<std::string> deps;
+    };
+
+    /**
+     * Time waited for other files after the first one of a batch (ms)
+     */
+    unsigned window;
+
+    /**
+     * Files of the next batch
+     */
+    std::vector<Pending> queue;
+
+    /**
+     * True when the thread has to end
+     */
+    bool stop = false;
+
+    /**
+     * Mutex and condition variable for the queue
+     */
+    std::mutex m;
+    std::condition_variable cv;
+
+    /**
+     * Thread flushing the batches
+     */
+    std::thread worker;
+
+    void run();
+
+    void place(std::vector<Pending>& batch, std::vector<bool>& res, bool first);
+
+    static bool syncFd(int fd, const std::string& path);
+
+    static bool syncDir(const std::string& path);
+
+public:
+
+    explicit GroupCommit(unsigned window);
+
+    ~GroupCommit();
+
+    void commit(int fd, std::string tmpPath, std::string path, std::function<void(bool)> done, bool first = false,
+                std::vector<std::string> deps = {});
+
+};
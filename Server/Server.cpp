@@ -4,108 +4,380 @@
 
 #include "Server.h"
 
+std::unordered_map<std::string, std::string> Server::credentials;
+std::filesystem::file_time_type Server::credentialsTime;
+std::shared_mutex Server::credentialsMutex;
+std::atomic<std::uint64_t> Server::tempCounter;
+std::map<std::string, std::weak_ptr<std::mutex>> Server::manifestLocks;
+std::mutex Server::manifestsMutex;
+#ifdef __linux__
+std::vector<std::unique_ptr<UringWriter>> Server::rings;
+std::atomic<unsigned> Server::nextRing;
+#endif
+
 /**
- * Bool for errors on message received and for probe status
+ * Constructor, the session is started by start()
+ * @param socket (it has to be initialized)
+ * @param wheel timer wheel for the deadlines of the session
+ * @param tasks thread pool for the blocking work of the session (login and index of the files)
+ * @param commits group commit of the received files
+ * @param store store of the chunks of the files (CHUNK_STORE)
  */
-auto msgErr = false, probeOp = false;
-
+Server::Server(boost::asio::ip::tcp::socket socket, TimerWheel& wheel, boost::asio::thread_pool& tasks, GroupCommit& commits, ChunkStore& store)
+        : socket(std::move(socket)), wheel(wheel), tasks(tasks), commits(commits), store(store){
+}
 
 /**
- * Empty constructor
- * @param socket (it has to be initialized)
+ * Start the session: the first message read has to be the login of the client
  */
-Server::Server(boost::asio::ip::tcp::socket socket): socket(std::move(socket)){
+void Server::start() {
+    readPrefix();
 }
 
 /**
- * Constructor with parameters
+ * Authenticate the client and reply to its login message (the session is closed on failure).
+ * Credentials check and index of the files of the client run on the task pool, so that a large tree
+ * doesn't hold the io_context: no message is read in the meantime, then the session goes on
  * @param clientName string for the username of the client
  * @param hashedPwd string for the hash of the pwd of the client
- * @param socket
  */
-Server::Server(const std::string& clientName, std::string hashedPwd, boost::asio::ip::tcp::socket socket)
-        : clientName(clientName), hashedPwd(std::move(hashedPwd)), socket(std::move(socket)) {
+void Server::authenticate(const std::string& clientName, std::string hashedPwd) {
 
-    if(authClient(this->clientName, this->hashedPwd)){
-        // Client directory created if not exists
-        if(!std::filesystem::is_directory(std::filesystem::path("../Root/" + this->clientName)))
-            std::filesystem::create_directory("../Root/" + this->clientName);
-        for(auto &file : std::filesystem::recursive_directory_iterator(std::filesystem::path("../Root/" + this->clientName)))
-            this->paths[file.path().string()] = false;
-        std::cout << "Authentication success: Hello, " << clientName << "!" << std::endl;
-        std::cout << "Sending Response..." << std::endl;
-        sendAck(1);
-        std::cout << "Response sent." << std::endl;
-    }
-    else{
-        std::cout << "Authentication failed!" << std::endl;
-        std::cout << "Sending Response..." << std::endl;
-        sendAck(0);
-        std::cout << "Response sent." << std::endl;
-        this->socket.close();
-    }
+    this->clientName = clientName;
+    this->hashedPwd = std::move(hashedPwd);
+
+    // The handshake deadline doesn't cover the index of the files
+    if (this->deadline)
+        this->wheel.cancel(this->deadline);
+    this->deadline = 0;
+
+    auto self = shared_from_this();
+    boost::asio::post(this->tasks, [this, self]() {
+        bool res = authClient(this->clientName, this->hashedPwd);
+        if(res){
+            // Client directory created if not exists
+            if(!std::filesystem::is_directory(std::filesystem::path("../Root/" + this->clientName)))
+                std::filesystem::create_directory("../Root/" + this->clientName);
+            indexPaths();
+            loadManifest();
+        }
+
+        boost::asio::post(this->socket.get_executor(), [this, self, res]() {
+            if(res){
+                this->authenticated = true;
+                std::cout << "Authentication success: Hello, " << this->clientName << "!" << std::endl;
+                sendAck(1);
+                if (this->socket.is_open())
+                    readPrefix();
+            }
+            else{
+                std::cout << "Authentication failed!" << std::endl;
+                sendAck(0);
+                // Closed once the ack is written
+                this->closing = true;
+            }
+        });
+    });
 }
 
 /**
- * Perform authentication of the client
+ * Perform authentication of the client against the credentials loaded from AUTH_FILE
+ * (reloaded first if the file has been modified)
  * @param clientName string for the username of the client
  * @param hashedPwd string for the hash of the pwd of the client
  * @return 1 if success, 0 if failed
  */
 int Server::authClient(const std::string& clientName, const std::string& hashedPwd) {
 
-    std::ifstream ifs("../auth.txt");
+    std::error_code err;
+    auto time = std::filesystem::last_write_time(AUTH_FILE, err);
+    if(err) {
+        std::cout << err.message() << std::endl;
+        return 0;
+    }
+
+    {
+        std::shared_lock<std::shared_mutex> lock(credentialsMutex);
+        if(time == credentialsTime) {
+            auto it = credentials.find(clientName);
+            return it != credentials.end() && it->second == hashedPwd;
+        }
+    }
+
+    loadCredentials(time);
+    std::shared_lock<std::shared_mutex> lock(credentialsMutex);
+    auto it = credentials.find(clientName);
+    return it != credentials.end() && it->second == hashedPwd;
+}
+
+/**
+ * Load the credentials of the clients from AUTH_FILE (pairs of username and hash of the pwd)
+ * @param time last write time of the file
+ */
+void Server::loadCredentials(std::filesystem::file_time_type time) {
+
+    std::unique_lock<std::shared_mutex> lock(credentialsMutex);
+    // Another session may have loaded it in the meantime
+    if(time == credentialsTime)
+        return;
+
+    std::ifstream ifs(AUTH_FILE);
     if(ifs.fail()) {
         std::cout << strerror(errno) << std::endl;
-        return 0;
+        return;
     }
-    std::string str;
+    std::unordered_map<std::string, std::string> table;
+    std::string name, pwd;
+    while(ifs >> name >> pwd)
+        table[name] = pwd;
 
-    while(!ifs.eof()) {
-        ifs >> str;
-        if (str == clientName) {
-            ifs >> str;
-            if (str == hashedPwd) {
-                return 1;
-            }
+    credentials = std::move(table);
+    credentialsTime = time;
+    std::cout << "Credentials loaded: " << credentials.size() << " clients" << std::endl;
+}
+
+/**
+ * Read the length prefix of the next message (or the beginning of the binary header)
+ */
+void Server::readPrefix() {
+
+    auto self = shared_from_this();
+    // The login has to arrive within HANDSHAKE_TIMEOUT from the connection
+    if (this->authenticated)
+        setDeadline(DELAY * PROBETIME * INT_NUM);
+    else if (!this->deadline)
+        setDeadline(HANDSHAKE_TIMEOUT);
+    this->buf.resize(MAX_MSG_LEN);
+    boost::asio::async_read(this->socket, boost::asio::buffer(this->buf),
+                            [this, self](const boost::system::error_code& err, std::size_t) {
+        if (err) {
+            closeSession(err);
+            return;
         }
-        else {
-            ifs >> str;
+
+        // The rest of the message has to follow shortly
+        if (this->authenticated)
+            setDeadline(REQUEST_TIMEOUT);
+        this->binary = Message::isBinaryFrame(this->buf);
+        if (this->binary) {
+            // Rest of the fixed header, then path and payload after it
+            this->buf.resize(BIN_HEADER_LEN);
+            boost::asio::async_read(this->socket, boost::asio::buffer(this->buf.data() + MAX_MSG_LEN, BIN_HEADER_LEN - MAX_MSG_LEN),
+                                    [this, self](const boost::system::error_code& err, std::size_t) {
+                if (err) {
+                    closeSession(err);
+                    return;
+                }
+                readBody(BIN_HEADER_LEN, Message::getBinaryBodyLen(this->buf));
+            });
+        } else {
+            std::size_t n;
+            try {
+                n = std::stoul(std::string(this->buf.begin(), this->buf.end()));
+            } catch (const std::exception& exc) {
+                std::cout << "Malformed length prefix" << std::endl;
+                closeSession();
+                return;
+            }
+            readBody(0, n);
         }
+    });
+}
+
+/**
+ * Move the deadline of the session: the session is closed if it isn't moved again in time.
+ * It is HANDSHAKE_TIMEOUT until the login is received, then the idle timeout (DELAY*PROBETIME*INT_NUM)
+ * while waiting for a message, as the client probes periodically, and REQUEST_TIMEOUT while the rest
+ * of a message is being read
+ * @param ms time to the deadline
+ */
+void Server::setDeadline(std::size_t ms) {
+
+    if (this->deadline)
+        this->wheel.cancel(this->deadline);
+    std::weak_ptr<Server> weak = weak_from_this();
+    this->deadline = this->wheel.schedule(ms, [weak](TimerWheel::Id expired) {
+        if (auto self = weak.lock())
+            boost::asio::post(self->socket.get_executor(), [self, expired]() { self->onDeadline(expired); });
+    });
+}
+
+/**
+ * Close the session at its deadline (unless it has been moved in the meantime)
+ * @param id identifier of the expired deadline
+ */
+void Server::onDeadline(TimerWheel::Id id) {
+
+    if (id != this->deadline || !socketIsOpen())
+        return;
+    this->deadline = 0;
+    std::cout << "Deadline expired, closing the session: " << this->clientName << std::endl;
+    closeSession();
+}
+
+/**
+ * Read the rest of a message, then handle it and go on with the next one
+ * @param offset bytes of the message already read
+ * @param n bytes to be read
+ */
+void Server::readBody(std::size_t offset, std::size_t n) {
+
+    if (n > Message::getMaxFrameLen(this->chunkSize)) {
+        // Larger than anything the negotiated chunk size allows, the stream can't be trusted anymore
+        std::cout << "Message too long: " << n << " bytes" << std::endl;
+        closeSession();
+        return;
     }
 
-    return 0;
+    auto self = shared_from_this();
+    this->buf.resize(offset + n);
+    boost::asio::async_read(this->socket, boost::asio::buffer(this->buf.data() + offset, n),
+                            [this, self](const boost::system::error_code& err, std::size_t) {
+        if (err) {
+            closeSession(err);
+            return;
+        }
+
+        Message mex{};
+        int parsed = this->binary ? mex.parseBinary(this->buf) : mex.parseJSON(this->buf);
+        if (parsed < 0) {
+            // A malformed frame is never handled (nor taken as a login), the stream can't be trusted anymore
+            std::cout << "Malformed message" << std::endl;
+            closeSession();
+            return;
+        }
+        this->ackSeq = mex.getSeq();
+
+        if (!this->authenticated) {
+            // The session goes on once the login is done
+            authenticate(mex.getFilePath(), mex.getDataHash());
+            return;
+        }
+
+        if (waitsForCommits(mex)) {
+            // The session goes on once the files are in their place, with no deadline in the meantime
+            if (this->deadline)
+                this->wheel.cancel(this->deadline);
+            this->deadline = 0;
+            this->held = std::move(mex);
+            return;
+        }
+
+        handleMessage(mex);
+        if (this->socket.is_open() && !this->paused)
+            readPrefix();
+    });
 }
 
 /**
- * Read a message from the socket
- * @return the obj Message read from the socket
+ * Handle a message according to the state of the session (probe phases or normal operations)
+ * @param mex Message received
  */
-Message Server::readMessage() {
+void Server::handleMessage(const Message& mex) {
 
-    Message mex{};
-    std::vector<char> buf(MAX_MSG_LEN);
-    boost::system::error_code err;
-    this->socket.wait(boost::asio::socket_base::wait_read);
-    boost::asio::read(this->socket, boost::asio::buffer(buf, MAX_MSG_LEN), err);
-    if (err) {
-        std::cout << err.message() << std::endl;
-        msgErr = true;
-        return mex;
+    switch (this->probePhase) {
+        case ProbePhase::check:
+            probeCheck(mex);
+            break;
+        case ProbePhase::sync:
+            probeOperation(mex);
+            break;
+        default: {
+            int res = executeOperation(mex);
+            if (res)
+                std::cout << "Operation " << getActionString(mex.getOpcode()) << " completed successfully!" << std::endl;
+            else
+                std::cout << "Error in operation " << getActionString(mex.getOpcode()) << "!" << std::endl;
+        }
     }
-    int n = std::stoi(buf.data());
-    buf.resize(n);
-    this->socket.wait(boost::asio::socket_base::wait_read);
-    boost::asio::read(socket, boost::asio::buffer(buf, n), err);
-    if (err) {
-        std::cout << err.message() << std::endl;
-        msgErr = true;
-        return mex;
+}
+
+/**
+ * Check if a message has to wait for the files of the session still in the group commit: the operations on
+ * those files (renames, removes) and the probes would otherwise run before the files are moved to their place
+ * @param mex Message received
+ * @return true if the message has to wait
+ */
+bool Server::waitsForCommits(const Message& mex) {
+
+    if (this->committing.empty())
+        return false;
+    std::string root("../Root/" + this->clientName + "/");
+    switch (mex.getOpcode()) {
+        case rename_file:
+        case rename_dir:
+            return isCommitting(root + mex.getFilePath()) ||
+                   isCommitting(root + std::string(mex.getFileData().begin(), mex.getFileData().end()));
+        case remove_entry:
+            return isCommitting(root + mex.getFilePath());
+        case start_probe:
+            return true;
+        case eop:
+            // End of the probe, its untracked entries are deleted
+            return this->probePhase == ProbePhase::sync && !this->streams.count(mex.getStream());
+        default:
+            return false;
     }
+}
 
-    mex.parseJSON(buf);
+/**
+ * @param path path of an entry
+ * @return true if the entry (or an entry it contains) is waiting for the group commit
+ */
+bool Server::isCommitting(const std::string& path) {
 
-    return mex;
+    if (this->committing.count(path))
+        return true;
+    std::string prefix(path + "/");
+    auto it = this->committing.lower_bound(prefix);
+    return it != this->committing.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+}
+
+/**
+ * Handle the held message once the files of the session are in their place, then go on reading
+ */
+void Server::resumeHeld() {
+
+    if (!this->held || waitsForCommits(*this->held) || !this->socket.is_open())
+        return;
+    Message mex = std::move(*this->held);
+    this->held.reset();
+    this->ackSeq = mex.getSeq();
+    handleMessage(mex);
+    if (this->socket.is_open() && !this->paused)
+        readPrefix();
+}
+
+/**
+ * Run blocking work of the session (hashes of the stored files) on the task pool, so that it doesn't hold
+ * the io_context: no message is read in the meantime and there is no deadline, then the session goes on
+ * @param work function run on the task pool
+ * @param done function run on the session once the work is done (e.g. sending the ack)
+ */
+void Server::runPaused(std::function<void()> work, std::function<void()> done) {
+
+    if (this->deadline)
+        this->wheel.cancel(this->deadline);
+    this->deadline = 0;
+    this->paused = true;
+
+    auto self = shared_from_this();
+    std::uint32_t seq = this->ackSeq;
+    boost::asio::post(this->tasks, [self, seq, work = std::move(work), done = std::move(done)]() {
+        work();
+        boost::asio::post(self->socket.get_executor(), [self, seq, done]() {
+            self->paused = false;
+            // Closed in the meantime: the manifest couldn't be saved while the work was using it
+            if (!self->socketIsOpen()) {
+                self->saveManifest();
+                return;
+            }
+            self->ackSeq = seq;
+            done();
+            if (self->socketIsOpen() && !self->paused)
+                self->readPrefix();
+        });
+    });
 }
 
 /**
@@ -116,11 +388,13 @@ Message Server::readMessage() {
 int Server::executeOperation(const Message& mex) {
 
     int res = 0;
+    // Data of the ack: bitmap of the stored chunks (check_chunks)
+    std::vector<char> reply;
 
     switch(mex.getOpcode()){
         case null:
             break;
-        case create_file: res = createFile(mex);
+        case create_file: res = writeChunk(mex);
             break;
         case create_dir: res = createDir(mex);
             break;
@@ -130,134 +404,805 @@ int Server::executeOperation(const Message& mex) {
             break;
         case remove_entry: res = removeEntry(mex);
             break;
-        case start_probe: res = probe(mex);
+        case start_probe: res = startProbe();
             break;
         case ping: res = 1;
             break;
+        case set_chunk: res = setChunkSize(mex);
+            break;
+        case eop: res = closeStream(mex);
+            break;
+        case have_content: res = haveContent(mex);
+            break;
+        case get_signature: res = blockSignatures(mex);
+            break;
+        case put_delta: res = writeDelta(mex);
+            break;
+        case check_chunks: res = checkChunks(mex, reply);
+            break;
+        case put_chunks: res = writeChunks(mex);
+            break;
         case ok:
             break;
-        case error: this->socket.close(); res = 1;
+        case error: closeSession(); res = 1;
             break;
-        case login: authClient(mex.getFilePath(), mex.getFileData().data());
+        case login: res = authClient(mex.getFilePath(), mex.getDataHash());
             break;
         default:
             break;
     }
 
-    // Map re-creation done not during probe
-    if(!probeOp) {
-        std::unordered_map<std::string, bool> tmp;
-        for (auto &file : std::filesystem::recursive_directory_iterator(std::filesystem::path("../Root/" + this->clientName +"/"))) {
-            std::string s(file.path().string());
-            //Paths in POSIX standard notation
-            std::replace(s.begin(), s.end(), '\\', '/');
-            tmp[s] = false;
+    // Chunks of a file are acknowledged all together by the eop of its stream
+    bool chunk = mex.getOpcode() == create_file || mex.getOpcode() == put_delta || mex.getOpcode() == put_chunks;
+
+    //Ack for probe operation is disabled, chunk negotiation replies with the accepted size
+    if(mex.getOpcode() == set_chunk)
+        sendAck(res, std::to_string(this->chunkSize));
+    else if(mex.getOpcode() == check_chunks)
+        sendAck(res, "", std::move(reply));
+    else if(mex.getOpcode() != start_probe && !chunk && !this->ackDeferred)
+        sendAck(res);
+    this->ackDeferred = false;
+
+    return res;
+}
+
+/**
+ * Send the ack to the client
+ * @param value int with value 1 if ack = OK, 0 if ack = ERROR
+ * @param info string sent as path of the ack instead of the username (if not empty)
+ * @param data data sent with an OK ack instead of "OK!" (if not empty)
+ */
+void Server::sendAck(int value, const std::string& info, std::vector<char> data) {
+
+    Message mex{};
+    mex.setOpcode(value ? ok : error);
+    mex.setFilePath(info.empty() ? this->clientName : info);
+    mex.setSeq(this->ackSeq);
+    if (!value || data.empty()) {
+        std::string s(value ? "OK!" : "ERROR!");
+        data.assign(s.data(), s.data() + s.size());
+    }
+    mex.setFileData(std::move(data));
+    send(mex.getFrame(this->binary));
+}
+
+/**
+ * Queue a frame to be written on the socket, frames are written one at a time in order
+ * @param frame frame of the message
+ */
+void Server::send(std::string frame) {
+
+    if (!this->socket.is_open())
+        return;
+    this->outbox.push_back(std::move(frame));
+    if (this->outbox.size() == 1)
+        writeNext();
+}
+
+/**
+ * Write the first queued frame, then the following ones
+ */
+void Server::writeNext() {
+
+    auto self = shared_from_this();
+    boost::asio::async_write(this->socket, boost::asio::buffer(this->outbox.front()),
+                             [this, self](const boost::system::error_code& err, std::size_t) {
+        if (err) {
+            closeSession(err);
+            return;
+        }
+        this->outbox.pop_front();
+        if (!this->outbox.empty())
+            writeNext();
+        else if (this->closing)
+            closeSession();
+    });
+}
+
+/**
+ * Stream of a message, the file is opened in TEMP_DIR on the first message of the stream (stream 0 is the serial transfer)
+ * @param message Message with a chunk of the file
+ * @return stream (failed if the file can't be opened)
+ */
+Server::Stream& Server::openStream(const Message& message) {
+
+    auto it = this->streams.find(message.getStream());
+    if(it == this->streams.end()) {
+        it = this->streams.try_emplace(message.getStream()).first;
+        it->second.path = "../Root/" + this->clientName + "/" + message.getFilePath();
+        it->second.tmpPath = TEMP_DIR + std::to_string(++tempCounter);
+        if(this->streams.size() > MAX_STREAMS) {
+            std::cout << "Too many open streams" << std::endl;
+            it->second.failed = true;
+        } else {
+            if(uringReady()) {
+                it->second.fd = open(it->second.tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if(it->second.fd < 0) {
+                    std::cout << strerror(errno) << std::endl;
+                    it->second.failed = true;
+                }
+            } else
+                it->second.ofs.open(it->second.tmpPath, std::fstream::out | std::ios::binary | std::ios_base::trunc);
+            if(it->second.ofs.fail()) {
+                std::cout << strerror(errno) << std::endl;
+                it->second.failed = true;
+            }
+        }
+    }
+
+    return it->second;
+}
+
+/**
+ * Append data to the file of a stream
+ * @param s stream
+ * @param data data to be written
+ * @param len length of the data
+ */
+void Server::appendData(Stream& s, const char* data, std::size_t len) {
+
+    if(s.fd >= 0)
+        writeAt(s, data, len);
+    else
+        s.ofs.write(data, len);
+    s.digest.update(data, len);
+}
+
+/**
+ * Write a chunk of a file.
+ * The file is written in TEMP_DIR and moved to its place on the eop, so a stored file is never half written
+ * @param message Message with the chunk of the file
+ * @return 1 if success, 0 if fail (the error is reported by the eop of the stream)
+ */
+int Server::writeChunk(const Message& message) {
+
+    int res = 0;
+    Stream &s = openStream(message);
+    if(s.failed)
+        return res;
+
+    if (message.getFileData().size() <= this->chunkSize && message.checkData()) {
+        appendData(s, message.getFileData().data(), message.getFileData().size());
+    } else {
+        s.failed = true;
+        return res;
+    }
+
+    res = 1;
+
+    return res;
+}
+
+/**
+ * Send the signatures of the blocks of a stored file to the client, for a delta transfer. The file is read
+ * on the task pool, so that a large file doesn't hold the io_context: the ack is sent when they are ready,
+ * the session goes on in the meantime
+ * @param message Message with the path of the file
+ * @return 1 if the signatures are being computed, 0 if the file can't have them (the client uploads the whole file)
+ */
+int Server::blockSignatures(const Message& message) {
+
+    // The stored files are chunk manifests, a changed file only uploads its new chunks
+    if(CHUNK_STORE)
+        return 0;
+
+    auto self = shared_from_this();
+    std::string path = "../Root/" + this->clientName + "/" + message.getFilePath();
+    std::uint32_t seq = this->ackSeq;
+    std::size_t chunkSize = this->chunkSize;
+    boost::asio::post(this->tasks, [self, path, seq, chunkSize]() {
+        std::vector<char> signature;
+        bool res = computeSignatures(path, chunkSize, signature);
+        boost::asio::post(self->socket.get_executor(), [self, seq, res, signature = std::move(signature)]() mutable {
+            self->ackSeq = seq;
+            self->sendAck(res, "", std::move(signature));
+        });
+    });
+    this->ackDeferred = true;
+
+    return 1;
+}
+
+/**
+ * Compute the signatures of the blocks of a stored file.
+ * The block size grows with the file (about its square root), so that the signatures fit in a chunk
+ * @param path path of the file
+ * @param chunkSize chunk size of the session
+ * @param signature block size and signatures of the blocks, see Message.h
+ * @return true if success, false if the file isn't stored
+ */
+bool Server::computeSignatures(const std::string& path, std::size_t chunkSize, std::vector<char>& signature) {
+
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    std::error_code err;
+    std::uintmax_t size = std::filesystem::file_size(path, err);
+    if(in.fail() || err)
+        return false;
+
+    std::size_t maxBlocks = (chunkSize - 4) / (4 + BLOCK_DIGEST_LEN);
+    std::uintmax_t blockSize = std::max<std::uintmax_t>(DELTA_BLOCK_SIZE, (std::uintmax_t) std::sqrt((double) size));
+    blockSize = std::max<std::uintmax_t>(blockSize, (size + maxBlocks - 1) / maxBlocks);
+    if(blockSize > UINT32_MAX)
+        return false;
+
+    Message::putUint32(signature, (std::uint32_t) blockSize);
+    std::vector<char> block(blockSize);
+    while(in.read(block.data(), (std::streamsize) blockSize) || in.gcount() > 0) {
+        std::size_t n = in.gcount();
+        Message::appendBlockSignature(signature, computeRollingChecksum(block.data(), n), computeBlockDigest(block.data(), n));
+    }
+
+    return true;
+}
+
+/**
+ * Write a message of a delta transfer: the runs of blocks are copied from the stored file, the literal runs
+ * are written as they are. The file is rebuilt in TEMP_DIR and moved to its place on the eop (see closeStream),
+ * where its digest is checked
+ * @param message Message with block size and runs (see Message.h)
+ * @return 1 if success, 0 if fail (the error is reported by the eop of the stream)
+ */
+int Server::writeDelta(const Message& message) {
+
+    Stream &s = openStream(message);
+    if(!s.failed && s.base < 0) {
+        s.base = open(s.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(s.base < 0) {
+            std::cout << strerror(errno) << std::endl;
+            s.failed = true;
+        }
+    }
+    const std::vector<char>& data = message.getFileData();
+    if(s.failed || data.size() > this->chunkSize || !message.checkData()) {
+        s.failed = true;
+        return 0;
+    }
+
+    std::size_t offset = 0;
+    std::uint32_t blockSize, first, count;
+    if(!Message::getUint32(data, offset, blockSize) || blockSize == 0)
+        s.failed = true;
+    while(!s.failed && offset < data.size()) {
+        char kind = data[offset++];
+        if(kind == 'C' && Message::getUint32(data, offset, first) && Message::getUint32(data, offset, count))
+            copyBlocks(s, blockSize, first, count);
+        else if(kind == 'L' && Message::getUint32(data, offset, count) && data.size() - offset >= count) {
+            appendData(s, data.data() + offset, count);
+            offset += count;
+        } else {
+            std::cout << "Malformed delta for file: " << s.path << std::endl;
+            s.failed = true;
+        }
+    }
+
+    return s.failed ? 0 : 1;
+}
+
+/**
+ * Copy a run of blocks of the stored file to the file of a stream
+ * @param s stream
+ * @param blockSize size of the blocks
+ * @param block first block
+ * @param count number of blocks (the last block of the file may be shorter)
+ */
+void Server::copyBlocks(Stream& s, std::uint32_t blockSize, std::uint32_t block, std::uint32_t count) {
+
+    off_t from = (off_t) block * blockSize;
+    std::uint64_t left = (std::uint64_t) count * blockSize;
+    std::vector<char> data(std::min<std::uint64_t>(left, this->chunkSize));
+    while(left > 0) {
+        ssize_t n = pread(s.base, data.data(), std::min<std::uint64_t>(left, data.size()), from);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0) {
+            std::cout << strerror(errno) << std::endl;
+            s.failed = true;
+        }
+        // End of the stored file
+        if(n <= 0)
+            break;
+        appendData(s, data.data(), n);
+        from += n;
+        left -= n;
+    }
+}
+
+/**
+ * Check which chunks of a file are already in the chunk store. The store is shared by all the users:
+ * a user can learn that a chunk with a given digest is stored, i.e. that some user stores that content
+ * @param message Message with the raw digests of the chunks
+ * @param bitmap bit i (LSB first) set if the chunk i is stored
+ * @return 1 if success, 0 if fail (the files aren't stored as chunks or the message is malformed)
+ */
+int Server::checkChunks(const Message& message, std::vector<char>& bitmap) {
+
+    const std::vector<char>& data = message.getFileData();
+    if(!CHUNK_STORE || data.empty() || data.size() % MAX_HASH_LEN)
+        return 0;
+
+    std::size_t n = data.size() / MAX_HASH_LEN;
+    bitmap.assign((n + 7) / 8, 0);
+    for(std::size_t i = 0; i < n; i++)
+        if(this->store.has(bytesToHex((const unsigned char*) data.data() + i * MAX_HASH_LEN, MAX_HASH_LEN)))
+            bitmap[i / 8] |= char(1 << (i % 8));
+
+    return 1;
+}
+
+/**
+ * Write a message of a file sent as chunks: the new chunks are stored, every chunk (new or already stored)
+ * is added to the chunk manifest of the file, written on the eop (see closeStream)
+ * @param message Message with the chunks (see Message.h)
+ * @return 1 if success, 0 if fail (the error is reported by the eop of the stream)
+ */
+int Server::writeChunks(const Message& message) {
+
+    Stream &s = openStream(message);
+    s.chunked = true;
+    const std::vector<char>& data = message.getFileData();
+    if(!CHUNK_STORE || s.failed || data.size() > this->chunkSize || !message.checkData()) {
+        s.failed = true;
+        return 0;
+    }
+
+    std::size_t offset = 0;
+    std::uint32_t len;
+    while(!s.failed && offset < data.size()) {
+        char kind = data[offset++];
+        std::string digest;
+        if(data.size() - offset >= MAX_HASH_LEN) {
+            digest = bytesToHex((const unsigned char*) data.data() + offset, MAX_HASH_LEN);
+            offset += MAX_HASH_LEN;
+        }
+        bool valid = !digest.empty() && Message::getUint32(data, offset, len);
+        if(valid && kind == 'D' && data.size() - offset >= len) {
+            if(!storeChunk(digest, data.data() + offset, len))
+                s.failed = true;
+            offset += len;
+        } else if(valid && kind == 'R') {
+            if(!this->store.has(digest, len)) {
+                std::cout << "Missing chunk " << digest << " for file: " << s.path << std::endl;
+                s.failed = true;
+            }
+        } else {
+            std::cout << "Malformed chunks for file: " << s.path << std::endl;
+            s.failed = true;
+        }
+        s.manifest += digest + " " + std::to_string(len) + "\n";
+        s.size += len;
+    }
+
+    return s.failed ? 0 : 1;
+}
+
+/**
+ * Store a chunk received or cut from a received file, the new chunks are made durable with the next group commit
+ * (moved to the store before the manifests of the same batch, the later manifests find them in place)
+ * @param digest hex digest of the chunk
+ * @param data content of the chunk
+ * @param len length of the chunk
+ * @return true if success, false if the content doesn't match the digest or it can't be stored
+ */
+bool Server::storeChunk(const std::string& digest, const char* data, std::size_t len) {
+
+    HashStream h;
+    h.update(data, len);
+    if(h.final() != digest) {
+        std::cout << "Chunk digest mismatch: " << digest << std::endl;
+        return false;
+    }
+    return this->store.put(digest, data, len);
+}
+
+/**
+ * Store a file received whole (or rebuilt) as a chunk manifest: the file is split in content-defined chunks,
+ * the ones not yet stored are added to the chunk store. Splitting and hashing run on the thread pool,
+ * then the manifest is committed. The operations on the file wait for it in the meantime
+ * @param tmpPath path of the file in TEMP_DIR (deleted)
+ * @param path path of the file
+ * @param digest hex representation of the SHA3-256 digest of the file
+ * @return 1 (the result is acknowledged once the manifest is durable, or on errors)
+ */
+int Server::storeFile(const std::string& tmpPath, const std::string& path, const std::string& digest) {
+
+    auto self = shared_from_this();
+    std::uint32_t seq = this->ackSeq;
+    std::string manifestPath = TEMP_DIR + std::to_string(++tempCounter);
+    this->committing[path]++;
+    boost::asio::post(this->tasks, [self, seq, tmpPath, manifestPath, path, digest]() {
+        std::string manifest;
+        std::uintmax_t size = 0;
+        bool ok = splitFile(tmpPath, [&](const char* data, std::size_t len) {
+            HashStream h;
+            h.update(data, len);
+            std::string chunk = h.final();
+            if(!self->store.put(chunk, data, len))
+                return false;
+            manifest += chunk + " " + std::to_string(len) + "\n";
+            size += len;
+            return true;
+        });
+        std::error_code err;
+        std::filesystem::remove(std::filesystem::path(tmpPath), err);
+        ok = ok && ChunkStore::writeManifest(manifestPath, digest, size, manifest);
+        std::vector<std::string> deps = self->store.chunkPaths(manifest);
+        boost::asio::post(self->socket.get_executor(), [self, seq, ok, manifestPath, path, digest, deps]() {
+            if (--self->committing[path] == 0)
+                self->committing.erase(path);
+            self->ackSeq = seq;
+            if (ok && self->commitFile(manifestPath, path, digest, deps)) {
+                self->ackDeferred = false;
+            } else {
+                std::error_code err;
+                std::filesystem::remove(std::filesystem::path(manifestPath), err);
+                if (self->committing.empty() && !self->socketIsOpen())
+                    self->saveManifest();
+                self->sendAck(0);
+            }
+            self->resumeHeld();
+        });
+    });
+    this->ackDeferred = true;
+
+    return 1;
+}
+
+/**
+ * Close the file of a stream on its eop, checking the digest of the whole file (if any), and move it to its place.
+ * The ack is sent once the file is durable (group commit, after splitting it in chunks with CHUNK_STORE),
+ * errors are acknowledged immediately
+ * @param message eop Message of the stream
+ * @return 1 if success, 0 if fail (the incomplete file is deleted, the stored one is untouched)
+ */
+int Server::closeStream(const Message& message) {
+
+    int res = 0;
+    auto it = this->streams.find(message.getStream());
+    if(it == this->streams.end()) {
+        std::cout << "Unknown stream: " << message.getStream() << std::endl;
+        return res;
+    }
+
+    Stream &s = it->second;
+    std::string fileDigest;
+    if(s.fd >= 0 && !closeFd(s))
+        s.failed = true;
+    if(!s.failed) {
+        if(s.ofs.is_open())
+            s.ofs.close();
+        fileDigest = s.digest.final();
+        if(s.ofs.fail()) {
+            std::cout << "Error on writing file: " << s.path << std::endl;
+            s.failed = true;
+        } else if(!s.chunked && !message.getDataHash().empty() && fileDigest != message.getDataHash()) {
+            std::cout << "File digest mismatch: " << s.path << std::endl;
+            s.failed = true;
+        }
+    }
+
+    if(!s.failed && s.chunked) {
+        res = commitChunks(s, message.getDataHash());
+        this->streams.erase(it);
+        return res;
+    }
+
+    if(s.failed) {
+        std::error_code err;
+        //Deleting incomplete files (due to errors)
+        std::filesystem::remove(std::filesystem::path(s.tmpPath), err);
+        if (err) {
+            std::cout << err.message() << std::endl;
         }
-        this->paths = std::move(tmp);
+    } else if(CHUNK_STORE && !s.chunked)
+        res = storeFile(s.tmpPath, s.path, fileDigest);
+    else
+        res = commitFile(s.tmpPath, s.path, fileDigest);
+    this->streams.erase(it);
+
+    return res;
+}
+
+/**
+ * Store a file sent as chunks as its manifest. The digest of the whole file isn't taken from the client:
+ * it is computed from the chunks (on the thread pool) and checked against the one sent, then the manifest
+ * is committed. The operations on the file wait for it in the meantime
+ * @param s stream of the file
+ * @param digest hex digest of the whole file sent by the client
+ * @return 1 (the result is acknowledged once the manifest is durable, or on errors)
+ */
+int Server::commitChunks(const Stream& s, const std::string& digest) {
+
+    auto self = shared_from_this();
+    std::uint32_t seq = this->ackSeq;
+    std::string tmpPath = s.tmpPath, path = s.path, manifest = s.manifest;
+    std::uintmax_t size = s.size;
+    this->committing[path]++;
+    boost::asio::post(this->tasks, [self, seq, tmpPath, path, manifest, size, digest]() {
+        std::string fileDigest = self->store.contentDigest(manifest);
+        bool ok = !fileDigest.empty() && fileDigest == digest;
+        if(!fileDigest.empty() && !ok)
+            std::cout << "File digest mismatch: " << path << std::endl;
+        ok = ok && ChunkStore::writeManifest(tmpPath, fileDigest, size, manifest);
+        std::vector<std::string> deps = self->store.chunkPaths(manifest);
+        boost::asio::post(self->socket.get_executor(), [self, seq, ok, tmpPath, path, fileDigest, deps]() {
+            if (--self->committing[path] == 0)
+                self->committing.erase(path);
+            self->ackSeq = seq;
+            if (ok && self->commitFile(tmpPath, path, fileDigest, deps)) {
+                self->ackDeferred = false;
+            } else {
+                std::error_code err;
+                std::filesystem::remove(std::filesystem::path(tmpPath), err);
+                if (self->committing.empty() && !self->socketIsOpen())
+                    self->saveManifest();
+                self->sendAck(0);
+            }
+            self->resumeHeld();
+        });
+    });
+    this->ackDeferred = true;
+
+    return 1;
+}
+
+/**
+ * Move a complete file from TEMP_DIR to its place through the group commit, which flushes it first:
+ * the ack is sent once the file is durable in its place. The operations on the stored entries
+ * wait for it in the meantime (see waitsForCommits)
+ * @param tmpPath path of the file in TEMP_DIR
+ * @param path path of the file
+ * @param digest hex representation of the SHA3-256 digest of the file
+ * @param deps paths of the chunks the file refers to (chunk manifest), it fails if they aren't stored
+ * @return 1 if success, 0 if fail (the file in TEMP_DIR is deleted)
+ */
+int Server::commitFile(const std::string& tmpPath, const std::string& path, const std::string& digest,
+                       std::vector<std::string> deps) {
+
+    // The parent directory can't be removed until the file is in its place, the operations on it wait
+    std::error_code err;
+    if(!std::filesystem::is_directory(std::filesystem::path(path).parent_path(), err)) {
+        std::cout << "Directory not found: " << path << std::endl;
+        std::filesystem::remove(std::filesystem::path(tmpPath), err);
+        return 0;
+    }
+    // The file in TEMP_DIR belongs to this session only
+    int fd = open(tmpPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        std::cout << strerror(errno) << std::endl;
+        std::filesystem::remove(std::filesystem::path(tmpPath), err);
+        return 0;
+    }
+
+    addPath(path);
+
+    // The session is kept alive by its commits, it may be waiting for them with no read in progress
+    auto self = shared_from_this();
+    std::uint32_t seq = this->ackSeq;
+    this->committing[path]++;
+    this->commits.commit(fd, tmpPath, path, [self, seq, path, digest](bool ok) {
+        boost::asio::post(self->socket.get_executor(), [self, seq, ok, path, digest]() {
+            if (--self->committing[path] == 0)
+                self->committing.erase(path);
+            if (ok)
+                self->storeHash(path, digest);
+            // The session closed while the files were in the group commit: the manifest is saved once they are stored
+            if (self->committing.empty() && !self->socketIsOpen())
+                self->saveManifest();
+            self->ackSeq = seq;
+            self->sendAck(ok);
+            self->resumeHeld();
+        });
+    }, false, std::move(deps));
+    this->ackDeferred = true;
+
+    return 1;
+}
+
+/**
+ * Create a file from a stored file with the same content (digest in the message), so that the client
+ * doesn't upload it: the data is cloned (reflink) or copied inside the kernel, nothing is done if the file
+ * itself is stored with that content. If the digest of the stored file has to be computed again, it is
+ * computed on the task pool and the ack is sent once the file is created
+ * @param message Message with the path of the file and the digest of its content
+ * @return 1 if success, 0 if there is no stored file with that content (the client uploads it)
+ */
+int Server::haveContent(const Message& message) {
+
+    const std::string& digest = message.getDataHash();
+    auto it = this->contents.find(digest);
+    if(digest.empty() || it == this->contents.end())
+        return 0;
+    std::string source = it->second;
+    std::string path = "../Root/" + this->clientName + "/" + message.getFilePath();
+    std::string stored;
+    std::uintmax_t size;
+    std::int64_t time;
+    if(cachedHash(source, stored, size, time))
+        return cloneContent(source, path, digest, stored);
+
+    auto computed = std::make_shared<std::string>();
+    runPaused([source, computed]() { *computed = readFileHash(source); },
+              [this, source, path, digest, size, time, computed]() {
+        putHash(source, size, time, *computed);
+        int res = cloneContent(source, path, digest, *computed);
+        if(!this->ackDeferred)
+            sendAck(res);
+        this->ackDeferred = false;
+    });
+    this->ackDeferred = true;
+
+    return 1;
+}
+
+/**
+ * Create a file from a stored file with the same content
+ * @param source path of the stored file
+ * @param path path of the file
+ * @param digest hex digest of the content of the file
+ * @param stored hex digest of the stored file (it may have changed since it was indexed by its content)
+ * @return 1 if success, 0 if fail (the client uploads the file)
+ */
+int Server::cloneContent(const std::string& source, const std::string& path, const std::string& digest, const std::string& stored) {
 
-        for (auto &path : this->paths)
-            std::cout << path.first << std::endl;
+    if(stored != digest) {
+        auto it = this->contents.find(digest);
+        if(it != this->contents.end() && it->second == source)
+            this->contents.erase(it);
+        return 0;
     }
+    // The stored copy has the content already (file touched or edits reverted), unless a commit replaces it
+    if(source == path && !isCommitting(path))
+        return 1;
+    std::string tmpPath = TEMP_DIR + std::to_string(++tempCounter);
+    if(!cloneFile(source, tmpPath))
+        return 0;
+    std::cout << "Content of " << path << " cloned from " << source << std::endl;
+    return commitFile(tmpPath, path, digest);
+}
 
-    //Ack for probe operation is disabled
-    if(mex.getOpcode() != start_probe)
-        sendAck(res);
+/**
+ * Clone a file: reflink where the filesystem supports it (FICLONE), copy_file_range otherwise
+ * @param from path of the source file
+ * @param to path of the new file
+ * @return true if success, false if fail (the new file is deleted)
+ */
+bool Server::cloneFile(const std::string& from, const std::string& to) {
 
-    msgErr = false;
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in < 0) {
+        std::cout << strerror(errno) << std::endl;
+        return false;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(out < 0) {
+        std::cout << strerror(errno) << std::endl;
+        close(in);
+        return false;
+    }
 
+    bool res = false;
+#ifdef __linux__
+    res = ioctl(out, FICLONE, in) == 0;
+    if(!res) {
+        struct stat st{};
+        res = fstat(in, &st) == 0;
+        for(off_t left = st.st_size; res && left > 0;) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, left, 0);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                res = false;
+            else
+                left -= n;
+        }
+    }
+#endif
+    if(!res)
+        std::cout << "Error on cloning " << from << ": " << strerror(errno) << std::endl;
+    close(in);
+    if(close(out) < 0)
+        res = false;
+    if(!res)
+        unlink(to.c_str());
     return res;
 }
 
 /**
- * Send the ack to the client
- * @param value int with value 1 if ack = OK, 0 if ack = ERROR
+ * Set up the rings shared by the sessions for the writes of the received chunks (IO_URING_WRITER),
+ * before the sessions start. No ring is set up if io_uring isn't available
+ * @param count number of rings
  */
-void Server::sendAck(int value) {
+void Server::initRings(unsigned count) {
 
-    boost::system::error_code err;
-    if (value) {
-        Message mex{};
-        mex.setOpcode(ok);
-        mex.setFilePath(this->clientName);
-        std::string s("OK!");
-        std::vector<char> v(s.data(), s.data() + s.size());
-        mex.setFileData(v);
-        this->socket.wait(boost::asio::socket_base::wait_write);
-        boost::asio::write(this->socket, boost::asio::buffer(mex.getJSON()), err);
-        if (err) {
-            std::cout << err.message() << std::endl;
-        }
-    } else {
-        Message mex{};
-        mex.setOpcode(error);
-        mex.setFilePath(this->clientName);
-        std::string s("ERROR!");
-        std::vector<char> v(s.data(), s.data() + s.size());
-        mex.setFileData(v);
-        this->socket.wait(boost::asio::socket_base::wait_write);
-        boost::asio::write(this->socket, boost::asio::buffer(mex.getJSON()), err);
-        if (err) {
-            std::cout << err.message() << std::endl;
-        }
+#ifdef __linux__
+    for(unsigned i = 0; IO_URING_WRITER && i < count; i++) {
+        auto ring = std::make_unique<UringWriter>();
+        if(!ring->init(URING_BUFFER_LEN))
+            return;
+        rings.push_back(std::move(ring));
     }
+#endif
 }
 
 /**
- * Create the file specified in the message
- * @param message Message with the info about the file to be created
- * @return 1 if success, 0 if fail
+ * Ring for the writes of the received chunks, assigned on the first upload of the session
+ * @return true if the chunks are written through io_uring, false if the ofstream is used
  */
-int Server::createFile(Message message) {
+bool Server::uringReady() {
 
-    int res = 0;
-    std::ofstream ofs;
-    std::string path("../Root/" + this->clientName + "/" + message.getFilePath());
-    ofs.open(path, std::fstream::out | std::ios::binary | std::ios_base::ate);
-    if(ofs.fail()){
-        msgErr = true;
-        std::cout << strerror(errno) << std::endl;
-    }
+#ifdef __linux__
+    if(!this->uring && !rings.empty())
+        this->uring = rings[nextRing++ % rings.size()].get();
+    return this->uring != nullptr;
+#else
+    return false;
+#endif
+}
 
-    // Eop signals the end of the file transfer
-    while(message.getOpcode() != eop) {
-        if(!msgErr) {
-            std::string hash = computeHash(message.getFileData());
-            if (hash == message.getDataHash()) {
-                ofs.write(message.getFileData().data(), message.getFileData().size());
-                message = readMessage();
-            } else {
-                ofs.close();
-                msgErr=true;
-                std::error_code err;
-                //Deleting incomplete files (due to errors)
-                std::filesystem::path p(path);
-                std::filesystem::remove_all(p, err);
-                if (err) {
-                    std::cout << err.message() << std::endl;
-                }
-                return res;
+/**
+ * Write a chunk at the current offset of the file of a stream, through the ring
+ * (directly if the ring has no free buffers for it)
+ * @param s stream
+ * @param data chunk
+ * @param len length of the chunk
+ */
+void Server::writeAt(Stream& s, const char* data, std::size_t len) {
+
+#ifdef __linux__
+    if(!this->uring->write(s.fd, data, len, s.offset)) {
+        for(std::size_t done = 0; done < len;) {
+            ssize_t n = pwrite(s.fd, data + done, len - done, s.offset + done);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0) {
+                std::cout << strerror(errno) << std::endl;
+                s.failed = true;
+                break;
             }
-        }
-        else{
-            /*If there was an error the server continues to receive the remaining messages
-                on the socket since the ack is sent only at the end of the transfer
-            */
-            message = readMessage();
+            done += n;
         }
     }
-    ofs.close();
+#endif
+    s.offset += len;
+}
 
-    if(msgErr)
-        return res;
+/**
+ * Wait for the writes of the file of a stream and close it
+ * @param s stream
+ * @return true if every write succeeded
+ */
+bool Server::closeFd(Stream& s) {
 
-    // Insertion of the new path in the paths map if in probe
-    if(probeOp){
-        this->paths.insert({path, false});
-    }
+    if(s.fd < 0)
+        return true;
+    bool res = true;
+#ifdef __linux__
+    res = this->uring->wait(s.fd);
+#endif
+    if(close(s.fd) < 0)
+        res = false;
+    s.fd = -1;
+    if(!res)
+        std::cout << "Error on writing file: " << s.path << std::endl;
+    return res;
+}
 
-    res = 1;
+/**
+ * Delete the incomplete files of the streams still open (e.g. when the connection is lost)
+ */
+void Server::abortStreams() {
 
-    return res;
+    std::error_code err;
+    for(auto &s : this->streams) {
+        s.second.ofs.close();
+        closeFd(s.second);
+        std::filesystem::remove(std::filesystem::path(s.second.tmpPath), err);
+        if (err) {
+            std::cout << err.message() << std::endl;
+        }
+    }
+    this->streams.clear();
 }
 
 /**
@@ -276,9 +1221,7 @@ int Server::createDir(const Message& message) {
         return res;
     }
 
-    if(probeOp){
-        this->paths.insert({("../Root/" + this->clientName + "/" + message.getFilePath()), false});
-    }
+    addPath(p.string());
 
     res = 1;
 
@@ -295,7 +1238,7 @@ int Server::renameFile(const Message& message) {
     int res = 0;
     std::error_code err;
     std::filesystem::path oldP("../Root/" + this->clientName + "/" + message.getFilePath());
-    std::filesystem::path newP("../Root/" + this->clientName + "/" + message.getFileData().data());
+    std::filesystem::path newP("../Root/" + this->clientName + "/" + std::string(message.getFileData().begin(), message.getFileData().end()));
     if(!std::filesystem::is_regular_file(oldP)){
         std::cout << "Not a regular file" << std::endl;
         return res;
@@ -305,6 +1248,7 @@ int Server::renameFile(const Message& message) {
         std::cout << err.message() << std::endl;
         return res;
     }
+    renamePaths(oldP.string(), newP.string());
     res = 1;
 
     return res;
@@ -320,7 +1264,7 @@ int Server::renameDir(const Message& message) {
     int res = 0;
     std::error_code err;
     std::filesystem::path oldP("../Root/" + this->clientName + "/" + message.getFilePath());
-    std::filesystem::path newP("../Root/" + this->clientName + "/" + message.getFileData().data());
+    std::filesystem::path newP("../Root/" + this->clientName + "/" + std::string(message.getFileData().begin(), message.getFileData().end()));
     if(!std::filesystem::is_directory(oldP)){
         std::cout << "Not a directory" << std::endl;
         return res;
@@ -330,6 +1274,7 @@ int Server::renameDir(const Message& message) {
         std::cout << err.message() << std::endl;
         return res;
     }
+    renamePaths(oldP.string(), newP.string());
     res = 1;
 
     return res;
@@ -350,12 +1295,7 @@ int Server::removeEntry(const Message& message) {
         std::cout << err.message() << std::endl;
         return res;
     }
-
-    if(probeOp){
-        auto it = this->paths.find("../Root/" + this->clientName + "/" + message.getFilePath());
-        if(it != this->paths.end())
-            this->paths.erase(it->first);
-    }
+    removePaths(p.string());
 
     res = 1;
 
@@ -363,75 +1303,586 @@ int Server::removeEntry(const Message& message) {
 }
 
 /**
- * Method for the probe command of client
- * @return
+ * Start the probe requested by the client: the first phase checks the entries of the client,
+ * the second one receives the operations for the invalid ones, then untracked entries are deleted
+ * @return 1
  */
-int Server::probe(Message message) {
-    probeOp = true;
-    std::string path;
-    std::unordered_map<std::string, bool>::iterator it;
+int Server::startProbe() {
 
-    message = readMessage();
-    while(message.getOpcode() != eop){
-        path = "../Root/" + this->clientName + "/" + message.getFilePath();
-        it = this->paths.find(path);
-        if(message.getOpcode() == check_file) {
-            if (it != this->paths.end() && computeFileHash(path) == message.getFileData().data()) {
-                // File is present in the server
-                it->second = true;
-                sendAck(1);
-            } else {
-                // File not present in the server
-                sendAck(0);
-            }
+    this->probePhase = ProbePhase::check;
+    for(auto &h : this->fileHashes)
+        h.second.used = false;
+    // Every entry is invalid until the client checks it
+    for(auto &a : this->paths)
+        a.second = false;
+    return 1;
+}
+
+/**
+ * First phase of the probe: check messages of the client, until eop
+ * @param message Message received
+ */
+void Server::probeCheck(const Message& message) {
+
+    if(message.getOpcode() == eop) {
+        this->probePhase = ProbePhase::sync;
+        return;
+    }
+
+    std::string path = "../Root/" + this->clientName + "/" + message.getFilePath();
+    auto it = this->paths.find(path);
+    // The files are hashed on the task pool: the session has no pending commit during the checks, no other
+    // handler uses its maps in the meantime
+    if(message.getOpcode() == check_file) {
+        std::string hash(message.getFileData().begin(), message.getFileData().end());
+        auto stored = std::make_shared<bool>(false);
+        runPaused([this, path, hash, stored]() {
+            auto entry = this->paths.find(path);
+            // File is present in the server
+            *stored = entry != this->paths.end() && fileHash(path) == hash;
+            if (*stored)
+                entry->second = true;
+        }, [this, stored]() { sendAck(*stored); });
+    }
+    else if(message.getOpcode() == check_dir){
+        if (it != this->paths.end()) {
+            it->second = true;
+            sendAck(1);
+        } else {
+            sendAck(0);
         }
-        else if(message.getOpcode() == check_dir){
-            if (it != this->paths.end()) {
-                it->second = true;
-                sendAck(1);
-            } else {
+    }
+    else if(message.getOpcode() == check_batch || message.getOpcode() == check_tree){
+        auto bitmap = std::make_shared<std::vector<char>>();
+        auto res = std::make_shared<int>(0);
+        runPaused([this, message, bitmap, res]() {
+            *res = message.getOpcode() == check_batch ? checkBatch(message, *bitmap) : checkTree(message, *bitmap);
+        }, [this, bitmap, res]() {
+            if (*res)
+                sendAck(1, "", std::move(*bitmap));
+            else
                 sendAck(0);
-            }
-        }
-        message = readMessage();
-    }
-
-    message = readMessage();
-    int res;
-    // Receiving operations for untracked entries
-    while(message.getOpcode() != eop){
-        res = executeOperation(message);
-        path = "../Root/" + this->clientName + "/" + message.getFilePath();
-        it = this->paths.find(path);
-        if(it != this->paths.end()) {
-            if (res) {
-                //File marked as valid
-                it->second = true;
-            } else {
-                // File marked as invalid
-                it->second = false;
-            }
+        });
+    }
+}
+
+/**
+ * Second phase of the probe: operations for untracked entries, until an eop
+ * that doesn't end the upload of a file
+ * @param message Message received
+ */
+void Server::probeOperation(const Message& message) {
+
+    if(message.getOpcode() == eop && !this->streams.count(message.getStream())) {
+        endProbe();
+        return;
+    }
+
+    int res = executeOperation(message);
+    std::string path = "../Root/" + this->clientName + "/" + message.getFilePath();
+    auto it = this->paths.find(path);
+    if(it != this->paths.end()) {
+        if (res) {
+            //File marked as valid
+            it->second = true;
+        } else {
+            // File marked as invalid
+            it->second = false;
         }
-        message = readMessage();
     }
+}
+
+/**
+ * End of the probe: deletion of the entries not present in the client
+ */
+void Server::endProbe() {
 
     std::error_code err;
     std::filesystem::path p;
-    // Deletion of the entries that are not present in the client
-    for(const auto& a: paths){
-        if(!a.second){
-            p = a.first;
+    // Deletion of the entries that are not present in the client (entries of matched subtrees are valid)
+    for(auto a = paths.begin(); a != paths.end();){
+        if(!a->second && !inMatchedDir(a->first)){
+            p = a->first;
             std::filesystem::remove_all(p, err);
             if(err){
                 std::cout << err.message() << std::endl;
             }
             else{
-                paths.erase(a.first);
+                auto h = this->fileHashes.find(a->first);
+                if(h != this->fileHashes.end()) {
+                    dropContent(h->second.digest, a->first);
+                    this->fileHashes.erase(h);
+                    this->manifestDirty = true;
+                }
+                // The entries of a removed directory follow it in the map
+                a = paths.erase(a);
+                continue;
             }
         }
+        a++;
+    }
+    // Every stored file has been visited by the tree, the digests of the files no more existing are dropped
+    if(!this->treeHashes.empty()) {
+        for(auto h = this->fileHashes.begin(); h != this->fileHashes.end();) {
+            if(!h->second.used) {
+                dropContent(h->second.digest, h->first);
+                h = this->fileHashes.erase(h);
+                this->manifestDirty = true;
+            } else
+                h++;
+        }
+    }
+    saveManifest();
+    this->treeHashes.clear();
+    this->matchedDirs.clear();
+    this->probePhase = ProbePhase::none;
+}
+
+/**
+ * Check a batch of entries during the probe, the stored ones are marked as valid
+ * @param message check_batch Message with the entries to be checked
+ * @param bitmap filled with a bit for every entry, set if the entry is stored on the server
+ * @return 1 if success, 0 if the batch is malformed
+ */
+int Server::checkBatch(const Message& message, std::vector<char>& bitmap) {
+
+    int res = 0;
+    std::size_t offset = 0, i = 0;
+    std::string rel, hash, path;
+    const std::vector<char>& batch = message.getFileData();
+
+    bitmap.clear();
+    while (offset < batch.size()) {
+        if (!Message::readCheckEntry(batch, offset, rel, hash))
+            return res;
+        if (i % 8 == 0)
+            bitmap.push_back(0);
+
+        path = "../Root/" + this->clientName + "/" + rel;
+        auto it = this->paths.find(path);
+        bool stored;
+        if (hash.empty())
+            stored = it != this->paths.end() && std::filesystem::is_directory(path);
+        else
+            stored = it != this->paths.end() && fileHash(path) == hash;
+        if (stored) {
+            it->second = true;
+            bitmap.back() = char(bitmap.back() | (1 << (i % 8)));
+        }
+        i++;
+    }
+
+    res = 1;
+
+    return res;
+}
+
+/**
+ * Compare the Merkle tree hashes of a batch of directories during the probe
+ * @param message check_tree Message with the directories to be checked
+ * @param bitmap filled with a bit for every directory, set if its whole subtree is the same on the server
+ * @return 1 if success, 0 if the batch is malformed
+ */
+int Server::checkTree(const Message& message, std::vector<char>& bitmap) {
+
+    int res = 0;
+    std::size_t offset = 0, i = 0;
+    std::string rel, hash, path;
+    std::string root("../Root/" + this->clientName);
+    const std::vector<char>& batch = message.getFileData();
+
+    // Tree of the client directory, computed once per probe
+    if (this->treeHashes.empty())
+        treeHash(root);
+
+    bitmap.clear();
+    while (offset < batch.size()) {
+        if (!Message::readCheckEntry(batch, offset, rel, hash))
+            return res;
+        if (i % 8 == 0)
+            bitmap.push_back(0);
+
+        path = rel.empty() ? root : root + "/" + rel;
+        auto it = this->treeHashes.find(path);
+        if (it != this->treeHashes.end() && it->second == hash) {
+            this->matchedDirs.insert(path);
+            auto p = this->paths.find(path);
+            if (p != this->paths.end())
+                p->second = true;
+            bitmap.back() = char(bitmap.back() | (1 << (i % 8)));
+        }
+        i++;
+    }
+
+    res = 1;
+
+    return res;
+}
+
+/**
+ * Digest of a stored file from the manifest, computed again only if the file changed since it was stored
+ * @param path path of the file
+ * @return hex representation of the SHA3-256 digest (empty string on errors)
+ */
+std::string Server::fileHash(const std::string& path) {
+
+    std::string digest;
+    std::uintmax_t size;
+    std::int64_t time;
+    if (!cachedHash(path, digest, size, time)) {
+        digest = readFileHash(path);
+        putHash(path, size, time, digest);
+    }
+    return digest;
+}
+
+/**
+ * Digest of a stored file from the manifest, if the file didn't change since it was stored
+ * @param path path of the file
+ * @param digest hex digest of the file (empty string if the file can't be read)
+ * @param size size of the file
+ * @param time last write time of the file
+ * @return true if found (or the file can't be read), false if the digest has to be computed
+ */
+bool Server::cachedHash(const std::string& path, std::string& digest, std::uintmax_t& size, std::int64_t& time) {
+
+    std::error_code err;
+    digest.clear();
+    size = std::filesystem::file_size(path, err);
+    time = err ? 0 : std::int64_t(std::filesystem::last_write_time(path, err).time_since_epoch().count());
+    if (err)
+        return true;
+
+    auto it = this->fileHashes.find(path);
+    if (it != this->fileHashes.end() && it->second.size == size && it->second.time == time) {
+        it->second.used = true;
+        digest = it->second.digest;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Compute the digest of a stored file (it doesn't use the session, it can run on the task pool)
+ * @param path path of the file
+ * @return hex representation of the SHA3-256 digest (empty string on errors)
+ */
+std::string Server::readFileHash(const std::string& path) {
+
+    // The digest of a file stored as chunks is in its manifest
+    std::string digest;
+    std::uintmax_t size;
+    if(!CHUNK_STORE || !ChunkStore::readHeader(path, digest, size))
+        digest = computeFileHash(path);
+    return digest;
+}
+
+/**
+ * Store in the manifest the digest of a file
+ * @param path path of the file
+ * @param size size of the file when the digest was computed
+ * @param time last write time of the file when the digest was computed
+ * @param digest hex representation of the SHA3-256 digest
+ */
+void Server::putHash(const std::string& path, std::uintmax_t size, std::int64_t time, const std::string& digest) {
+
+    this->fileHashes[path] = {size, time, digest, true};
+    this->manifestDirty = true;
+    if (!digest.empty())
+        this->contents[digest] = path;
+}
+
+/**
+ * Store in the manifest the digest of a file computed while receiving it
+ * @param path path of the file
+ * @param digest hex representation of the SHA3-256 digest
+ */
+void Server::storeHash(const std::string& path, const std::string& digest) {
+
+    std::error_code err;
+    std::uintmax_t fileSize = std::filesystem::file_size(path, err);
+    std::int64_t time = err ? 0 : std::int64_t(std::filesystem::last_write_time(path, err).time_since_epoch().count());
+    if (digest.empty() || err)
+        return;
+    putHash(path, fileSize, time, digest);
+}
+
+/**
+ * Load the manifest of the client (one line per file: size, last write time, digest and path)
+ */
+void Server::loadManifest() {
+
+    std::ifstream ifs(MANIFEST_DIR + this->clientName);
+    std::string root("../Root/" + this->clientName + "/"), rel;
+    FileHash h{0, 0, "", false};
+
+    // Mutex of the manifest shared with the other sessions of the user, the ones of the users gone are dropped
+    {
+        std::lock_guard<std::mutex> guard(manifestsMutex);
+        for (auto it = manifestLocks.begin(); it != manifestLocks.end();)
+            it = it->second.expired() ? manifestLocks.erase(it) : std::next(it);
+        std::weak_ptr<std::mutex>& lock = manifestLocks[this->clientName];
+        this->manifestLock = lock.lock();
+        if (!this->manifestLock) {
+            this->manifestLock = std::make_shared<std::mutex>();
+            lock = this->manifestLock;
+        }
+    }
+
+    this->fileHashes.clear();
+    this->contents.clear();
+    if (ifs.fail())
+        return;
+    while (ifs >> h.size >> h.time >> h.digest && ifs.get() == ' ' && std::getline(ifs, rel)) {
+        this->fileHashes[root + rel] = h;
+        this->contents[h.digest] = root + rel;
+    }
+}
+
+/**
+ * Save the manifest of the client (if changed): its lines are taken here, the file is written
+ * on the task pool (see writeManifest)
+ */
+void Server::saveManifest() {
+
+    if (!this->manifestDirty || this->clientName.empty() || !this->manifestLock)
+        return;
+
+    std::string root("../Root/" + this->clientName + "/");
+    auto lines = std::make_shared<std::unordered_map<std::string, std::string>>();
+    for (auto &h : this->fileHashes) {
+        if (h.second.digest.empty() || h.first.compare(0, root.size(), root) != 0 || h.first.find('\n') != std::string::npos)
+            continue;
+        std::string rel(h.first.substr(root.size()));
+        (*lines)[rel] = std::to_string(h.second.size) + " " + std::to_string(h.second.time) + " " + h.second.digest + " " + rel;
+    }
+    this->manifestDirty = false;
+
+    auto self = shared_from_this();
+    std::uint64_t version = ++this->manifestVersion;
+    boost::asio::post(this->tasks, [self, lines, version]() {
+        if (!self->writeManifest(*lines, version))
+            boost::asio::post(self->socket.get_executor(), [self]() { self->manifestDirty = true; });
+    });
+}
+
+/**
+ * Write the manifest of the client aside and rename it, so that it is never truncated.
+ * The saves of the sessions of the same user are serialized: the digests saved by the other sessions
+ * for files this session doesn't know are kept, if the files still exist
+ * @param lines lines of the manifest by path of the file (relative to the directory of the client)
+ * @param version version of the save, it isn't written if a later save of the session has been written
+ * @return true if success
+ */
+bool Server::writeManifest(const std::unordered_map<std::string, std::string>& lines, std::uint64_t version) {
+
+    std::error_code err;
+    std::string root("../Root/" + this->clientName + "/");
+    std::string path(MANIFEST_DIR + this->clientName);
+    std::string tmp(path + "." + std::to_string(++tempCounter));
+    std::lock_guard<std::mutex> guard(*this->manifestLock);
+    if (version < this->manifestSaved)
+        return true;
+
+    std::filesystem::create_directories(MANIFEST_DIR, err);
+    std::ofstream ofs(tmp, std::ios::trunc);
+    std::ifstream ifs(path);
+    std::string line, rel;
+    FileHash h{0, 0, "", false};
+    while (std::getline(ifs, line)) {
+        std::istringstream iss(line);
+        if (iss >> h.size >> h.time >> h.digest && iss.get() == ' ' && std::getline(iss, rel) &&
+            !lines.count(rel) && std::filesystem::exists(root + rel, err))
+            ofs << line << "\n";
+    }
+    for (auto &l : lines)
+        ofs << l.second << "\n";
+    ofs.close();
+    if (ofs.fail()) {
+        std::cout << "Error on saving the manifest" << std::endl;
+        std::filesystem::remove(tmp, err);
+        return false;
+    }
+    std::filesystem::rename(tmp, path, err);
+    if (err) {
+        std::cout << err.message() << std::endl;
+        return false;
+    }
+    this->manifestSaved = version;
+    return true;
+}
+
+/**
+ * Compute the Merkle tree hash of a stored directory and of all its subdirectories
+ * @param dir path of the directory
+ * @return hex representation of the tree hash
+ */
+std::string Server::treeHash(const std::string& dir) {
+
+    std::error_code err;
+    std::vector<std::pair<std::string, std::string>> entries;
+    for (auto &entry : std::filesystem::directory_iterator(dir, err)) {
+        std::string path(entry.path().string());
+        if (entry.is_directory(err))
+            entries.emplace_back(entry.path().filename().string(), "d" + treeHash(path));
+        else
+            entries.emplace_back(entry.path().filename().string(), "f" + fileHash(path));
+    }
+
+    std::string hash = computeTreeHash(entries);
+    this->treeHashes[dir] = hash;
+    return hash;
+}
+
+/**
+ * @param path path of a stored entry
+ * @return true if the entry is inside a directory whose subtree matched the client during the probe
+ */
+bool Server::inMatchedDir(const std::string& path) {
+
+    std::string root("../Root/" + this->clientName);
+    std::size_t pos = path.size();
+    while (!this->matchedDirs.empty() && (pos = path.rfind('/', pos - 1)) != std::string::npos && pos >= root.size()) {
+        if (this->matchedDirs.count(path.substr(0, pos)))
+            return true;
+        if (pos == 0)
+            break;
+    }
+    return false;
+}
+
+/**
+ * Negotiate the maximum data chunk length of the session
+ * @param message Message with the requested chunk size as path
+ * @return 1 if success, 0 if the requested size is not valid
+ */
+int Server::setChunkSize(const Message& message) {
+
+    int res = 0;
+    std::size_t requested;
+    try {
+        requested = std::stoul(message.getFilePath());
+    } catch (const std::exception& exc) {
+        return res;
+    }
+    if(requested == 0)
+        return res;
+
+    this->chunkSize = std::min<std::size_t>(requested, MAX_CHUNK_LEN);
+    std::cout << "Chunk size set to " << this->chunkSize << " bytes" << std::endl;
+    res = 1;
+
+    return res;
+}
+
+/**
+ * Build the image of the client directory from the disk (at the start of the session)
+ */
+void Server::indexPaths() {
+
+    std::error_code err;
+    this->paths.clear();
+    for (auto &file : std::filesystem::recursive_directory_iterator(std::filesystem::path("../Root/" + this->clientName), err)) {
+        std::string s(file.path().string());
+        //Paths in POSIX standard notation
+        std::replace(s.begin(), s.end(), '\\', '/');
+        this->paths[s] = false;
+    }
+}
+
+/**
+ * Insert an entry in the image of the client directory, together with its parent directories
+ * @param path path of the entry
+ */
+void Server::addPath(const std::string& path) {
+
+    std::string root("../Root/" + this->clientName);
+    std::string p(path);
+    // The entries created by the client during the probe are valid (e.g. files committed after their eop)
+    bool valid = this->probePhase == ProbePhase::sync;
+    while (p.size() > root.size() && this->paths.insert({p, valid}).second)
+        p.erase(p.rfind('/'));
+}
+
+/**
+ * Remove an entry from the image of the client directory, together with the entries it contains
+ * @param path path of the entry
+ */
+void Server::removePaths(const std::string& path) {
+
+    std::string prefix(path + "/");
+    auto first = this->paths.lower_bound(prefix);
+    auto last = first;
+    while (last != this->paths.end() && last->first.compare(0, prefix.size(), prefix) == 0)
+        last++;
+    bool dir = first != last;
+    this->paths.erase(first, last);
+    this->paths.erase(path);
+
+    // The content of the removed files can't be cloned anymore
+    auto h = this->fileHashes.find(path);
+    if (h != this->fileHashes.end()) {
+        dropContent(h->second.digest, path);
+        this->fileHashes.erase(h);
+        this->manifestDirty = true;
+    }
+    if (dir) {
+        for (h = this->fileHashes.begin(); h != this->fileHashes.end();) {
+            if (h->first.compare(0, prefix.size(), prefix) == 0) {
+                dropContent(h->second.digest, h->first);
+                h = this->fileHashes.erase(h);
+                this->manifestDirty = true;
+            } else
+                h++;
+        }
+    }
+}
+
+/**
+ * Forget a file as the stored copy of a content, if it is
+ * @param digest hex digest of the file
+ * @param path path of the file
+ */
+void Server::dropContent(const std::string& digest, const std::string& path) {
+
+    auto it = this->contents.find(digest);
+    if (it != this->contents.end() && it->second == path)
+        this->contents.erase(it);
+}
+
+/**
+ * Move an entry of the image of the client directory (and the entries it contains) after a rename,
+ * the digests of the files are moved as well, so that their content is found at the new path
+ * @param oldPath old path of the entry
+ * @param newPath new path of the entry
+ */
+void Server::renamePaths(const std::string& oldPath, const std::string& newPath) {
+
+    std::string prefix(oldPath + "/");
+    std::vector<std::string> moved;
+    auto first = this->paths.lower_bound(prefix);
+    auto last = first;
+    for (; last != this->paths.end() && last->first.compare(0, prefix.size(), prefix) == 0; last++)
+        moved.push_back(last->first);
+    this->paths.erase(first, last);
+    this->paths.erase(oldPath);
+    moved.push_back(oldPath);
+
+    addPath(newPath);
+    for (auto &p : moved) {
+        std::string q(newPath + p.substr(oldPath.size()));
+        this->paths[q] = false;
+        auto h = this->fileHashes.find(p);
+        if (h != this->fileHashes.end()) {
+            FileHash fh = std::move(h->second);
+            this->fileHashes.erase(h);
+            auto c = this->contents.find(fh.digest);
+            if (c != this->contents.end() && c->second == p)
+                c->second = q;
+            this->fileHashes[q] = std::move(fh);
+            this->manifestDirty = true;
+        }
     }
-    probeOp = false;
-    return 1;
 }
 
 /**
@@ -446,8 +1897,31 @@ bool Server::socketIsOpen(){
  * Close the socket (if is opened)
  */
 void Server::closeSocket() {
-    if(socketIsOpen())
-        this->socket.close();
+    if(socketIsOpen()) {
+        boost::system::error_code err;
+        this->socket.close(err);
+    }
+}
+
+/**
+ * End of the session on a socket error or when the client disconnects: incomplete files
+ * are deleted and the manifest is saved (again when the files still in the group commit are stored)
+ * @param err error of the last operation on the socket (none if the session is closed by the server)
+ */
+void Server::closeSession(const boost::system::error_code& err) {
+    if(!socketIsOpen())
+        return;
+    if(err && err != boost::asio::error::eof)
+        std::cout << err.message() << std::endl;
+    if (this->deadline)
+        this->wheel.cancel(this->deadline);
+    this->deadline = 0;
+    closeSocket();
+    abortStreams();
+    // Saved once the work on the task pool is done otherwise (see runPaused)
+    if (!this->paused)
+        saveManifest();
+    std::cout << "Socket closed!" << std::endl;
 }
 
 /**
@@ -466,16 +1940,6 @@ const std::string &Server::getHashedPwd() const {
     return hashedPwd;
 }
 
-/**
- * Getter for readable bytes on the socket
- * @return readable bytes
- */
-boost::asio::ip::tcp::socket::bytes_readable Server::getIOControl() {
-    boost::asio::ip::tcp::socket::bytes_readable b;
-    this->socket.io_control(b);
-    return b;
-}
-
 /**
  * Setter for clientName
  * @param clientName string with the value to be assigned to clientName
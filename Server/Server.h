@@ -6,23 +6,81 @@
 
 #include "../Common/Message.h"
 #include "../Common/Parameters.h"
+#include "TimerWheel.h"
+#include "GroupCommit.h"
+#include "UringWriter.h"
+#include "ChunkStore.h"
 #include <vector>
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cerrno>
 #include <filesystem>
 #include <utility>
+#include <map>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <unordered_set>
+#include <shared_mutex>
+#include <mutex>
+#include <sstream>
+#include <atomic>
+#include <cmath>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/lexical_cast.hpp>
 
+// File of the credentials of the clients
+#define AUTH_FILE "../auth.txt"
 
-class Server {
+// Directory of the files being received, moved to their place when complete (outside Root, so that it can't
+// be the directory of a user, on the same filesystem)
+#define TEMP_DIR "../Temp/"
+
+// Directory of the chunks of the files (CHUNK_STORE), outside Root as TEMP_DIR
+#define CHUNK_DIR "../Chunks/"
+
+// Chunks written through io_uring (Linux only), the ofstream is used if it isn't available
+#define IO_URING_WRITER true
+
+// Length of the buffers of the rings: a chunk larger than a buffer is split, a MAX_CHUNK_LEN one fits in a ring
+#define URING_BUFFER_LEN (MAX_CHUNK_LEN / URING_BUFFERS)
+
+// Time waited to flush the received files together (ms)
+#define COMMIT_WINDOW 5
+
+// Directory of the manifests of the users (digests of the stored files)
+#define MANIFEST_DIR "../Manifest/"
+
+// Time allowed to the client to send the rest of a message once its beginning is received (ms)
+#define REQUEST_TIMEOUT 10000
+
+// Time allowed to the client to log in once connected (ms)
+#define HANDSHAKE_TIMEOUT 5000
+
+// Time waited before accepting again after an accept error, e.g. out of file descriptors (ms)
+#define ACCEPT_RETRY_DELAY 100
+
+// Minimum block size of the signatures for the delta transfers (larger files have larger blocks)
+#define DELTA_BLOCK_SIZE 2048
+
+
+/**
+ * Session with a client, driven by the asynchronous operations on its socket
+ */
+class Server : public std::enable_shared_from_this<Server> {
 
     /**
      * String for the username of the client
@@ -40,26 +98,314 @@ class Server {
     boost::asio::ip::tcp::socket socket;
 
     /**
-     * Map for the image of the filesystem
+     * Timer wheel shared by the sessions
+     */
+    TimerWheel& wheel;
+
+    /**
+     * Current deadline of the session on the wheel (0 if none)
+     */
+    TimerWheel::Id deadline = 0;
+
+    /**
+     * Thread pool for the blocking work of the sessions
+     */
+    boost::asio::thread_pool& tasks;
+
+    /**
+     * Group commit of the received files
+     */
+    GroupCommit& commits;
+
+    /**
+     * Store of the chunks of the files (CHUNK_STORE)
+     */
+    ChunkStore& store;
+
+    /**
+     * True if the ack of the current operation is sent later (eop waiting for the group commit)
+     */
+    bool ackDeferred = false;
+
+    /**
+     * Files of the session waiting for the group commit (not yet in their place), with the number of commits of each
+     */
+    std::map<std::string, std::size_t> committing;
+
+    /**
+     * Message that can't be handled before the pending files are in their place (e.g. the remove of one of them),
+     * no other message is read until it is handled
+     */
+    std::optional<Message> held;
+
+    /**
+     * True while blocking work of the session runs on the task pool (see runPaused), no message is read
+     */
+    bool paused = false;
+
+    /**
+     * Map for the image of the filesystem, kept up to date by the operations
+     * (ordered, so that the entries of a directory follow it)
+     */
+    std::map<std::string, bool> paths;
+
+    /**
+     * True if the client speaks binary frames (replies use the same format)
+     */
+    bool binary = false;
+
+    /**
+     * Maximum data chunk length negotiated with the client
+     */
+    std::size_t chunkSize = MAX_BODY_LEN;
+
+    /**
+     * Sequence number of the last message read, echoed by the acks
+     */
+    std::uint32_t ackSeq = 0;
+
+    /**
+     * Buffer of the message being read
+     */
+    std::vector<char> buf;
+
+    /**
+     * Frames waiting to be written on the socket (the first one is being written)
+     */
+    std::deque<std::string> outbox;
+
+    /**
+     * True once the login of the client succeeded
+     */
+    bool authenticated = false;
+
+    /**
+     * True if the session has to be closed once the queued frames are written
+     */
+    bool closing = false;
+
+    /**
+     * Phase of the probe requested by the client (check of the entries, then operations)
+     */
+    enum class ProbePhase { none, check, sync };
+    ProbePhase probePhase = ProbePhase::none;
+
+    /**
+     * File being received on a stream
+     */
+    struct Stream {
+        std::string path;
+        std::string tmpPath;
+        std::ofstream ofs;
+        int fd = -1;
+        off_t offset = 0;
+        HashStream digest;
+        bool failed = false;
+        // Stored file the blocks of a delta are copied from (-1 if none)
+        int base = -1;
+        // File sent as chunks (put_chunks): lines of its chunk manifest and its length
+        bool chunked = false;
+        std::string manifest;
+        std::uintmax_t size = 0;
+
+        Stream() = default;
+
+        Stream(const Stream&) = delete;
+
+        Stream& operator=(const Stream&) = delete;
+
+        // The descriptors still open are closed with the stream
+        ~Stream() {
+            if (fd >= 0)
+                close(fd);
+            if (base >= 0)
+                close(base);
+        }
+    };
+
+    /**
+     * Open files of the uploads, by stream ID
+     */
+    std::unordered_map<std::uint32_t, Stream> streams;
+
+#ifdef __linux__
+    /**
+     * Ring for the writes of the chunks, one of the shared rings (nullptr until the first upload)
+     */
+    UringWriter* uring = nullptr;
+
+    /**
+     * Rings shared by the sessions (as many as the worker threads), so that the memory of the buffers
+     * doesn't grow with the sessions; a session always uses the same one and writes a chunk directly
+     * when its ring has no free buffer, so that it never waits for the writes of the other sessions
+     */
+    static std::vector<std::unique_ptr<UringWriter>> rings;
+
+    /**
+     * Counter for the assignment of the rings to the sessions
+     */
+    static std::atomic<unsigned> nextRing;
+#endif
+
+    /**
+     * Digests of the stored files, valid while size and last write time are unchanged.
+     * It is the manifest of the user, saved in MANIFEST_DIR
+     */
+    struct FileHash {
+        std::uintmax_t size;
+        std::int64_t time;
+        std::string digest;
+        bool used;
+    };
+    std::unordered_map<std::string, FileHash> fileHashes;
+
+    /**
+     * True if the manifest has to be saved
+     */
+    bool manifestDirty = false;
+
+    /**
+     * Mutex of the manifest of the user, shared by its sessions (see manifestLocks)
      */
-    std::unordered_map<std::string, bool> paths;
+    std::shared_ptr<std::mutex> manifestLock;
+
+    /**
+     * Version of the last save of the manifest started by the session and of the last one written
+     * (guarded by manifestLock): an older save written late doesn't replace a newer one
+     */
+    std::uint64_t manifestVersion = 0;
+    std::uint64_t manifestSaved = 0;
+
+    /**
+     * A stored file for every known digest, to create files from the content already on the server
+     * (checked before use, the file may have changed)
+     */
+    std::unordered_map<std::string, std::string> contents;
+
+    /**
+     * Merkle tree hashes of the stored directories, computed at the first check_tree of a probe
+     */
+    std::unordered_map<std::string, std::string> treeHashes;
+
+    /**
+     * Directories whose whole subtree matched the client during the probe
+     */
+    std::unordered_set<std::string> matchedDirs;
+
+    /**
+     * Credentials of the clients (hash of the pwd by username), shared by the sessions
+     * and loaded again when AUTH_FILE is modified
+     */
+    static std::unordered_map<std::string, std::string> credentials;
+
+    /**
+     * Last write time of AUTH_FILE when the credentials were loaded
+     */
+    static std::filesystem::file_time_type credentialsTime;
+
+    /**
+     * Mutex for the credentials: logins read them concurrently, a reload replaces them
+     */
+    static std::shared_mutex credentialsMutex;
+
+    /**
+     * Counter for the names of the files in TEMP_DIR
+     */
+    static std::atomic<std::uint64_t> tempCounter;
+
+    /**
+     * Mutex for the manifest of every user with a session: the saves of its sessions are serialized
+     */
+    static std::map<std::string, std::weak_ptr<std::mutex>> manifestLocks;
+
+    /**
+     * Mutex for manifestLocks
+     */
+    static std::mutex manifestsMutex;
 
 
 public:
 
-    Server(boost::asio::ip::tcp::socket socket);
+    Server(boost::asio::ip::tcp::socket socket, TimerWheel& wheel, boost::asio::thread_pool& tasks, GroupCommit& commits, ChunkStore& store);
+
+    void start();
 
-    Server(const std::string& clientName, std::string  hashedPwd, boost::asio::ip::tcp::socket socket);
+    void authenticate(const std::string& clientName, std::string hashedPwd);
 
     static int authClient(const std::string& clientName, const std::string& hashedPwd);
 
-    Message readMessage();
+    static void loadCredentials(std::filesystem::file_time_type time);
+
+    static void initRings(unsigned count);
+
+    void readPrefix();
+
+    void setDeadline(std::size_t ms);
+
+    void onDeadline(TimerWheel::Id id);
+
+    void readBody(std::size_t offset, std::size_t n);
+
+    void handleMessage(const Message& mex);
+
+    bool waitsForCommits(const Message& mex);
+
+    bool isCommitting(const std::string& path);
+
+    void resumeHeld();
+
+    void runPaused(std::function<void()> work, std::function<void()> done);
 
     int executeOperation(const Message& mex);
 
-    void sendAck(int value);
+    void sendAck(int value, const std::string& info = "", std::vector<char> data = {});
+
+    void send(std::string frame);
+
+    void writeNext();
 
-    int createFile(Message message);
+    Stream& openStream(const Message& message);
+
+    void appendData(Stream& s, const char* data, std::size_t len);
+
+    int writeChunk(const Message& message);
+
+    int blockSignatures(const Message& message);
+
+    static bool computeSignatures(const std::string& path, std::size_t chunkSize, std::vector<char>& signature);
+
+    int writeDelta(const Message& message);
+
+    void copyBlocks(Stream& s, std::uint32_t blockSize, std::uint32_t block, std::uint32_t count);
+
+    int checkChunks(const Message& message, std::vector<char>& bitmap);
+
+    int writeChunks(const Message& message);
+
+    bool storeChunk(const std::string& digest, const char* data, std::size_t len);
+
+    int storeFile(const std::string& tmpPath, const std::string& path, const std::string& digest);
+
+    int closeStream(const Message& message);
+
+    int commitChunks(const Stream& s, const std::string& digest);
+
+    void abortStreams();
+
+    int commitFile(const std::string& tmpPath, const std::string& path, const std::string& digest,
+                   std::vector<std::string> deps = {});
+
+    int haveContent(const Message& message);
+
+    int cloneContent(const std::string& source, const std::string& path, const std::string& digest, const std::string& stored);
+
+    static bool cloneFile(const std::string& from, const std::string& to);
+
+    bool uringReady();
+
+    void writeAt(Stream& s, const char* data, std::size_t len);
+
+    bool closeFd(Stream& s);
 
     int createDir(const Message& message);
 
@@ -69,18 +415,60 @@ public:
 
     int removeEntry(const Message& message);
 
-    int probe(Message message);
+    int startProbe();
+
+    void probeCheck(const Message& message);
+
+    void probeOperation(const Message& message);
+
+    void endProbe();
+
+    int checkBatch(const Message& message, std::vector<char>& bitmap);
+
+    int checkTree(const Message& message, std::vector<char>& bitmap);
+
+    std::string fileHash(const std::string& path);
+
+    bool cachedHash(const std::string& path, std::string& digest, std::uintmax_t& size, std::int64_t& time);
+
+    static std::string readFileHash(const std::string& path);
+
+    void putHash(const std::string& path, std::uintmax_t size, std::int64_t time, const std::string& digest);
+
+    void storeHash(const std::string& path, const std::string& digest);
+
+    void loadManifest();
+
+    void saveManifest();
+
+    bool writeManifest(const std::unordered_map<std::string, std::string>& lines, std::uint64_t version);
+
+    std::string treeHash(const std::string& dir);
+
+    bool inMatchedDir(const std::string& path);
+
+    int setChunkSize(const Message& message);
+
+    void indexPaths();
+
+    void addPath(const std::string& path);
+
+    void removePaths(const std::string& path);
+
+    void dropContent(const std::string& digest, const std::string& path);
+
+    void renamePaths(const std::string& oldPath, const std::string& newPath);
 
     bool socketIsOpen();
 
     void closeSocket();
 
+    void closeSession(const boost::system::error_code& err = {});
+
     const std::string &getClientName() const;
 
     const std::string &getHashedPwd() const;
 
-    boost::asio::ip::tcp::socket::bytes_readable getIOControl();
-
     void setClientName(const std::string &clientName);
 
     void setHashedPwd(const std::string &hashedPwd);
@@ -0,0 +1,136 @@
+#include "TimerWheel.h"
+
+/**
+ * Constructor
+ * @param ioCtx io_context running the timer of the wheel
+ */
+TimerWheel::TimerWheel(boost::asio::io_context& ioCtx): timer(ioCtx) {
+}
+
+/**
+ * Start moving the wheel forward
+ */
+void TimerWheel::start() {
+    this->origin = std::chrono::steady_clock::now();
+    wait();
+}
+
+/**
+ * Schedule a deadline
+ * @param ms time to the deadline (rounded up to WHEEL_TICK)
+ * @param callback function to be run at the deadline with its identifier (by the thread of the wheel, it shouldn't block)
+ * @return identifier of the deadline, for cancel()
+ */
+TimerWheel::Id TimerWheel::schedule(std::size_t ms, std::function<void(Id)> callback) {
+
+    std::lock_guard<std::mutex> lock(this->m);
+    std::uint64_t ticks = (ms + WHEEL_TICK - 1) / WHEEL_TICK;
+    std::uint64_t expiry = this->now + (ticks ? ticks : 1);
+    Slot& slot = slotFor(expiry);
+    Id id = ++this->lastId;
+    slot.push_back(Entry{id, expiry, std::move(callback)});
+    this->index.emplace(id, std::make_pair(&slot, std::prev(slot.end())));
+    return id;
+}
+
+/**
+ * Cancel a deadline (nothing is done if it is already expired)
+ * @param id identifier of the deadline
+ */
+void TimerWheel::cancel(Id id) {
+
+    std::lock_guard<std::mutex> lock(this->m);
+    auto it = this->index.find(id);
+    if (it == this->index.end())
+        return;
+    it->second.first->erase(it->second.second);
+    this->index.erase(it);
+}
+
+/**
+ * Slot for a deadline: the level is given by the distance from the current tick,
+ * the slot by the bits of the expiry tick for that level
+ * @param expiry tick of the deadline
+ * @return slot of the wheel
+ */
+TimerWheel::Slot& TimerWheel::slotFor(std::uint64_t expiry) {
+
+    std::uint64_t delta = expiry - this->now;
+    std::uint64_t span = WHEEL_SLOTS;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= span) {
+        span *= WHEEL_SLOTS;
+        level++;
+    }
+    std::uint64_t shift = 1;
+    for (int i = 0; i < level; i++)
+        shift *= WHEEL_SLOTS;
+    // Deadlines beyond the last level wait in its farthest slot
+    if (level == WHEEL_LEVELS - 1 && delta >= span)
+        expiry = this->now + span - shift;
+    return this->levels[level][(expiry / shift) % WHEEL_SLOTS];
+}
+
+/**
+ * Wait for the next tick
+ */
+void TimerWheel::wait() {
+
+    std::uint64_t next;
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        next = this->now + 1;
+    }
+    this->timer.expires_at(this->origin + std::chrono::milliseconds(next * WHEEL_TICK));
+    this->timer.async_wait([this](const boost::system::error_code& err) {
+        if (err)
+            return;
+        auto elapsed = std::chrono::steady_clock::now() - this->origin;
+        advance(elapsed / std::chrono::milliseconds(WHEEL_TICK));
+        wait();
+    });
+}
+
+/**
+ * Move the wheel up to a tick, cascading the entries of the upper levels and running the expired callbacks
+ * @param target tick to be reached (ticks missed by a late timer are recovered)
+ */
+void TimerWheel::advance(std::uint64_t target) {
+
+    Slot expired;
+    {
+        std::lock_guard<std::mutex> lock(this->m);
+        while (this->now < target) {
+            this->now++;
+            // Entries of an upper slot are spread on the lower levels when the lower one wraps around
+            std::uint64_t shift = 1;
+            for (int level = 1; level < WHEEL_LEVELS; level++) {
+                if ((this->now / shift) % WHEEL_SLOTS)
+                    break;
+                shift *= WHEEL_SLOTS;
+                Slot& upper = this->levels[level][(this->now / shift) % WHEEL_SLOTS];
+                while (!upper.empty()) {
+                    auto it = upper.begin();
+                    if (it->expiry <= this->now) {
+                        this->index[it->id].first = &expired;
+                        expired.splice(expired.end(), upper, it);
+                    } else {
+                        Slot& lower = slotFor(it->expiry);
+                        this->index[it->id].first = &lower;
+                        lower.splice(lower.end(), upper, it);
+                    }
+                }
+            }
+            Slot& current = this->levels[0][this->now % WHEEL_SLOTS];
+            for (auto &e : current)
+                this->index[e.id].first = &expired;
+            expired.splice(expired.end(), current);
+        }
+        for (auto &e : expired)
+            this->index.erase(e.id);
+    }
+
+    // Callbacks run without the lock, they can schedule new deadlines
+    for (auto &e : expired)
+        e.callback(e.id);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// Resolution of the timer wheel (ms)
+#define WHEEL_TICK 100
+
+// Levels of the wheel and slots for each level (each level covers WHEEL_SLOTS times the previous one)
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOTS 64
+
+
+/**
+ * Hierarchical timer wheel shared by all the sessions: deadlines are kept in the slots of the wheel,
+ * a single timer of the io_context moves it forward every WHEEL_TICK ms.
+ * Scheduling, cancelling and expiring a deadline take O(1), whatever the number of sessions
+ */
+class TimerWheel {
+
+public:
+
+    /**
+     * Identifier of a scheduled deadline (0 is never used)
+     */
+    using Id = std::uint64_t;
+
+private:
+
+    /**
+     * Scheduled deadline: tick of expiry and callback to be run
+     */
+    struct Entry {
+        Id id;
+        std::uint64_t expiry;
+        std::function<void(Id)> callback;
+    };
+
+    using Slot = std::list<Entry>;
+
+    /**
+     * Slots of the levels, level 0 has the nearest deadlines
+     */
+    std::array<std::array<Slot, WHEEL_SLOTS>, WHEEL_LEVELS> levels;
+
+    /**
+     * Position of the scheduled deadlines, for cancellation
+     */
+    std::unordered_map<Id, std::pair<Slot*, Slot::iterator>> index;
+
+    /**
+     * Current tick of the wheel
+     */
+    std::uint64_t now = 0;
+
+    /**
+     * Last identifier given
+     */
+    Id lastId = 0;
+
+    /**
+     * Mutex for the sessions running on different threads
+     */
+    std::mutex m;
+
+    /**
+     * Timer moving the wheel forward
+     */
+    boost::asio::steady_timer timer;
+
+    /**
+     * Time of tick 0
+     */
+    std::chrono::steady_clock::time_point origin;
+
+    Slot& slotFor(std::uint64_t expiry);
+
+    void wait();
+
+    void advance(std::uint64_t target);
+
+public:
+
+    explicit TimerWheel(boost::asio::io_context& ioCtx);
+
+    void start();
+
+    Id schedule(std::size_t ms, std::function<void(Id)> callback);
+
+    void cancel(Id id);
+
+};
@@ -0,0 +1,222 @@
+#include "UringWriter.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Destructor, the writes in progress are completed before the ring is released
+ */
+UringWriter::~UringWriter() {
+
+    if (this->ringFd < 0)
+        return;
+    while (this->buffers.size() != this->freeBuffers.size() && enter(this->toSubmit, 1)) {
+        this->toSubmit = 0;
+        reap();
+    }
+    if (this->sqes)
+        munmap(this->sqes, this->sqesLen);
+    if (this->cqPtr && this->cqPtr != this->sqPtr)
+        munmap(this->cqPtr, this->cqLen);
+    if (this->sqPtr)
+        munmap(this->sqPtr, this->sqLen);
+    close(this->ringFd);
+}
+
+/**
+ * Set up the ring and its buffers
+ * @param bufLen length of the buffers (chunk size)
+ * @return true if success, false if io_uring isn't available (the caller uses another way)
+ */
+bool UringWriter::init(std::size_t bufLen) {
+
+    io_uring_params params{};
+    this->ringFd = (int) syscall(__NR_io_uring_setup, URING_BUFFERS, &params);
+    if (this->ringFd < 0) {
+        std::cout << "io_uring not available: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    this->sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->cqLen = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        this->sqLen = this->cqLen = std::max(this->sqLen, this->cqLen);
+
+    this->sqPtr = mmap(nullptr, this->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQ_RING);
+    if (this->sqPtr == MAP_FAILED) {
+        this->sqPtr = nullptr;
+        return false;
+    }
+    this->cqPtr = single ? this->sqPtr : mmap(nullptr, this->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_CQ_RING);
+    if (this->cqPtr == MAP_FAILED) {
+        this->cqPtr = nullptr;
+        return false;
+    }
+    this->sqesLen = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqesPtr = mmap(nullptr, this->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQES);
+    if (sqesPtr == MAP_FAILED)
+        return false;
+    this->sqes = static_cast<io_uring_sqe*>(sqesPtr);
+
+    char *sq = static_cast<char*>(this->sqPtr), *cq = static_cast<char*>(this->cqPtr);
+    this->sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    this->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    this->sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    this->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    this->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    this->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    this->cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    this->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    this->bufLen = bufLen;
+    std::vector<iovec> iovecs(URING_BUFFERS);
+    for (unsigned i = 0; i < URING_BUFFERS; i++) {
+        this->buffers.emplace_back(new char[bufLen]);
+        iovecs[i].iov_base = this->buffers.back().get();
+        iovecs[i].iov_len = bufLen;
+        this->freeBuffers.push_back(URING_BUFFERS - 1 - i);
+    }
+    this->slots.resize(URING_BUFFERS);
+    // Without registered buffers (e.g. memlock limit) the same buffers are used by plain writes
+    this->fixed = syscall(__NR_io_uring_register, this->ringFd, IORING_REGISTER_BUFFERS, iovecs.data(), URING_BUFFERS) == 0;
+
+    return true;
+}
+
+/**
+ * Queue the write of a chunk, in as many buffers as it needs
+ * @param fd file descriptor of the file
+ * @param data chunk
+ * @param len length of the chunk
+ * @param offset position of the chunk in the file
+ * @return true if queued, false if there are not enough free buffers (the caller writes it)
+ */
+bool UringWriter::write(int fd, const char* data, std::size_t len, off_t offset) {
+
+    std::size_t count = (len + this->bufLen - 1) / this->bufLen;
+    std::lock_guard<std::mutex> lock(this->m);
+
+    // The buffers of the writes already completed are released, the others are not waited for
+    reap();
+    if (count > this->freeBuffers.size())
+        return false;
+
+    for (std::size_t done = 0; done < len; done += this->bufLen) {
+        unsigned buf = this->freeBuffers.back();
+        this->freeBuffers.pop_back();
+        std::size_t n = std::min(this->bufLen, len - done);
+        memcpy(this->buffers[buf].get(), data + done, n);
+        this->slots[buf] = Slot{fd, off_t(offset + done), n, 0};
+        queue(buf);
+        this->files[fd].count++;
+    }
+    // On errors the writes stay queued, wait() reports them
+    if (this->toSubmit >= URING_BATCH && enter(this->toSubmit, 0))
+        this->toSubmit = 0;
+
+    return true;
+}
+
+/**
+ * Queue the write of (the rest of) a buffer
+ * @param buf index of the buffer
+ */
+void UringWriter::queue(unsigned buf) {
+
+    const Slot &s = this->slots[buf];
+    // The ring has an entry for each buffer, so it is never full
+    unsigned tail = *this->sqTail;
+    unsigned index = tail & *this->sqMask;
+    io_uring_sqe *sqe = &this->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = this->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = s.fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(this->buffers[buf].get() + s.written);
+    sqe->len = s.len - s.written;
+    sqe->off = s.offset + s.written;
+    sqe->buf_index = buf;
+    sqe->user_data = buf;
+    this->sqArray[index] = index;
+    __atomic_store_n(this->sqTail, tail + 1, __ATOMIC_RELEASE);
+    this->toSubmit++;
+}
+
+/**
+ * Wait for the writes of a file
+ * @param fd file descriptor of the file
+ * @return true if every write succeeded
+ */
+bool UringWriter::wait(int fd) {
+
+    std::lock_guard<std::mutex> lock(this->m);
+    auto it = this->files.find(fd);
+    if (it == this->files.end())
+        return true;
+
+    while (it->second.count > 0) {
+        if (!enter(this->toSubmit, 1))
+            return false;
+        this->toSubmit = 0;
+        reap();
+    }
+    bool res = !it->second.failed;
+    this->files.erase(it);
+    return res;
+}
+
+/**
+ * Submit the queued writes and wait for completions
+ * @param submit number of writes to be submitted
+ * @param minComplete number of completions to wait for
+ * @return true if success
+ */
+bool UringWriter::enter(unsigned submit, unsigned minComplete) {
+
+    while (syscall(__NR_io_uring_enter, this->ringFd, submit, minComplete,
+                   minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0) {
+        if (errno != EINTR) {
+            std::cout << "io_uring error: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Collect the completed writes, releasing their buffers (the rest of a short write is queued again)
+ */
+void UringWriter::reap() {
+
+    unsigned head = *this->cqHead;
+    while (head != __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe *cqe = &this->cqes[head & *this->cqMask];
+        unsigned buf = (unsigned) cqe->user_data;
+        int res = cqe->res;
+        head++;
+        Slot &s = this->slots[buf];
+        if (res > 0 && s.written + res < s.len) {
+            s.written += res;
+            queue(buf);
+            continue;
+        }
+        Pending &p = this->files[s.fd];
+        p.count--;
+        if (res <= 0) {
+            std::cout << "Error on writing chunk: " << (res < 0 ? strerror(-res) : "no byte written") << std::endl;
+            p.failed = true;
+        }
+        this->freeBuffers.push_back(buf);
+    }
+    __atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+}
+
+#endif
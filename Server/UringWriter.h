@@ -0,0 +1,112 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+// Buffers of the writer (chunks being written at the same time)
+#define URING_BUFFERS 16
+
+// Writes queued before they are submitted to the kernel
+#define URING_BATCH 4
+
+
+/**
+ * Writer of the received chunks through an io_uring (raw system calls, no liburing):
+ * every chunk is copied in the buffers registered with the ring (split if larger than a buffer) and written
+ * at its offset, the writes are submitted in batches and completed while the session goes on reading the socket.
+ * A write never waits for a buffer: if there are not enough free ones the caller writes the chunk itself.
+ * A file has to be waited for (wait()) before it is closed. A writer can be shared by the sessions
+ */
+class UringWriter {
+
+    /**
+     * File descriptor of the ring
+     */
+    int ringFd = -1;
+
+    /**
+     * Submission and completion rings mapped from the kernel
+     */
+    void *sqPtr = nullptr, *cqPtr = nullptr;
+    std::size_t sqLen = 0, cqLen = 0;
+    io_uring_sqe *sqes = nullptr;
+    std::size_t sqesLen = 0;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    /**
+     * Writes queued and not yet submitted
+     */
+    unsigned toSubmit = 0;
+
+    /**
+     * Write of a buffer: file, position in the file, length and bytes already written
+     */
+    struct Slot {
+        int fd;
+        off_t offset;
+        std::size_t len;
+        std::size_t written;
+    };
+
+    /**
+     * Buffers of the chunks, their writes and the free ones
+     */
+    std::vector<std::unique_ptr<char[]>> buffers;
+    std::vector<Slot> slots;
+    std::vector<unsigned> freeBuffers;
+    std::size_t bufLen = 0;
+
+    /**
+     * True if the buffers are registered with the ring (fixed writes)
+     */
+    bool fixed = false;
+
+    /**
+     * Writes in progress for every file and result of the completed ones
+     */
+    struct Pending {
+        unsigned count = 0;
+        bool failed = false;
+    };
+    std::unordered_map<int, Pending> files;
+
+    /**
+     * Mutex for the sessions sharing the writer
+     */
+    std::mutex m;
+
+    bool enter(unsigned submit, unsigned minComplete);
+
+    void queue(unsigned buf);
+
+    void reap();
+
+public:
+
+    UringWriter() = default;
+
+    UringWriter(const UringWriter&) = delete;
+
+    UringWriter& operator=(const UringWriter&) = delete;
+
+    ~UringWriter();
+
+    bool init(std::size_t bufLen);
+
+    bool write(int fd, const char* data, std::size_t len, off_t offset);
+
+    bool wait(int fd);
+
+};
+
+#endif
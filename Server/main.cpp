@@ -1,48 +1,77 @@
 #include <iostream>
 #include "Server.h"
-#include "ThreadPool.h"
-
-// Maximum number of running threads
-#define MAX_NUM_THREAD 5
 
 
 using boost::asio::ip::tcp;
 
-int main() {
+/**
+ * Accept the connections of the clients, each one becomes a session on the io_context.
+ * After an error (e.g. out of file descriptors) the next accept waits ACCEPT_RETRY_DELAY, instead of failing again at once
+ * @param acceptor acceptor of the server
+ * @param wheel timer wheel for the deadlines of the sessions
+ * @param tasks thread pool for the blocking work of the sessions
+ * @param commits group commit of the received files
+ * @param store store of the chunks of the files
+ */
+void acceptClient(tcp::acceptor& acceptor, TimerWheel& wheel, boost::asio::thread_pool& tasks, GroupCommit& commits, ChunkStore& store) {
+
+    acceptor.async_accept(boost::asio::make_strand(acceptor.get_executor()),
+                          [&acceptor, &wheel, &tasks, &commits, &store](const boost::system::error_code& err, tcp::socket socket) {
+        if (err) {
+            std::cout << err.message() << std::endl;
+            auto timer = std::make_shared<boost::asio::steady_timer>(acceptor.get_executor(), std::chrono::milliseconds(ACCEPT_RETRY_DELAY));
+            timer->async_wait([&acceptor, &wheel, &tasks, &commits, &store, timer](const boost::system::error_code&) {
+                acceptClient(acceptor, wheel, tasks, commits, store);
+            });
+            return;
+        }
+        std::make_shared<Server>(std::move(socket), wheel, tasks, commits, store)->start();
+        acceptClient(acceptor, wheel, tasks, commits, store);
+    });
+}
 
-    ThreadPool tp{MAX_NUM_THREAD};
+int main() {
 
     boost::asio::io_context ioCtx;
-    boost::system::error_code err;
     tcp::acceptor acceptor(ioCtx, tcp::endpoint(boost::asio::ip::address::from_string(IP_SERVER), PORT_NUM));
 
-    while(true) {
+    // Credentials of the clients, loaded again by the logins when the file changes
+    std::error_code err;
+    auto authTime = std::filesystem::last_write_time(AUTH_FILE, err);
+    if (!err)
+        Server::loadCredentials(authTime);
 
-        tcp::socket socket(ioCtx);
-        std::cout << "Server waiting..." << std::endl;
-        acceptor.accept(socket);
+    // Deadlines of all the sessions
+    TimerWheel wheel{ioCtx};
+    wheel.start();
 
-        std::vector<char> buf(MAX_MSG_LEN);
-        Message mex;
-        boost::asio::read(socket, boost::asio::buffer(buf, MAX_MSG_LEN), err);
-        int n = std::stoi(buf.data());
-        buf.resize(n);
-        boost::asio::read(socket, boost::asio::buffer(buf, n), err);
-        mex.parseJSON(buf);
+    unsigned numThreads = std::max(1u, std::thread::hardware_concurrency());
+    // Rings for the writes of the received chunks, shared by the sessions
+    Server::initRings(numThreads);
+    // Login and index of the files of the clients, off the io_context
+    boost::asio::thread_pool tasks{numThreads};
 
-        Server server{mex.getFilePath(), mex.getDataHash(), std::move(socket)};
+    // Files left incomplete by a previous run are dropped
+    std::filesystem::remove_all(TEMP_DIR, err);
+    std::filesystem::create_directories(TEMP_DIR, err);
+    std::filesystem::create_directories("../Root/", err);
+    GroupCommit commits{COMMIT_WINDOW};
 
-        if (server.socketIsOpen()) {
-            std::cout << "Socket is still opened." << std::endl;
-        } else {
-            std::cout << "Socket has been closed." << std::endl;
-            continue;
-        }
+    // Chunks no file refers to anymore are deleted before the sessions start
+    ChunkStore store{CHUNK_DIR, TEMP_DIR, commits};
+    if (CHUNK_STORE && store.init())
+        store.collect("../Root/");
 
-        if(tp.newThread(std::move(server)))
-            std::cout << "Thread detached" << std::endl;
-        else
-            std::cout << "Pool full, cannot detach a thread" << std::endl;
-    }
-}
+    std::cout << "Server waiting..." << std::endl;
+    acceptClient(acceptor, wheel, tasks, commits, store);
 
+    // Sessions run on a strand each, so the worker threads never share one
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < numThreads; i++)
+        workers.emplace_back([&ioCtx] { ioCtx.run(); });
+    ioCtx.run();
+
+    for (auto &w : workers)
+        w.join();
+    tasks.join();
+}
@@ -5,8 +5,14 @@
 #include <istream>
 #include <fstream>
 #include <cstring>
+#include <algorithm>
 #include "Utilities.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC32C_HW
+#include <nmmintrin.h>
+#endif
+
 #define BUF_SIZE 1024
 /**
  * Utility function for SHA3-256 hashing
@@ -28,12 +34,7 @@ std::string computeHash(const std::vector<char>& data) {
 
     EVP_MD_CTX_free(ctx);
 
-    std::stringstream ss;
-    ss<<std::hex<<std::setfill('0');
-    for(int i=0; i<md_len; i++)
-        ss<<std::setw(2)<<static_cast<unsigned>(md_value[i]);
-
-    return ss.str();
+    return bytesToHex(md_value, md_len);
 }
 
 /**
@@ -69,12 +70,210 @@ std::string computeFileHash(const std::string& path){
     EVP_MD_CTX_free(ctx);
     fs.close();
 
-    std::stringstream ss;
-    ss<<std::hex<<std::setfill('0');
-    for(int i=0; i<md_len; i++)
-        ss<<std::setw(2)<<static_cast<unsigned>(md_value[i]);
+    return bytesToHex(md_value, md_len);
+}
+
+/*
+ * CRC32C (Castagnoli polynomial, reflected) is computed with the SSE4.2 crc32
+ * instruction when the CPU supports it (checked once at runtime) and with a
+ * lookup table otherwise.
+ */
+static std::uint32_t crc32cTable(std::uint32_t crc, const unsigned char* data, std::size_t len) {
+    static const auto table=[]{
+        std::vector<std::uint32_t> t(256);
+        for(std::uint32_t i=0; i<256; i++){
+            std::uint32_t c=i;
+            for(int k=0; k<8; k++)
+                c=(c & 1) ? (c>>1) ^ 0x82F63B78 : c>>1;
+            t[i]=c;
+        }
+        return t;
+    }();
+
+    while(len--)
+        crc=table[(crc ^ *data++) & 0xFF] ^ (crc>>8);
+    return crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+static std::uint32_t crc32cHardware(std::uint32_t crc, const unsigned char* data, std::size_t len) {
+#ifdef __x86_64__
+    std::uint64_t crc64=crc;
+    for(; len>=8; len-=8, data+=8){
+        std::uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64=_mm_crc32_u64(crc64, word);
+    }
+    crc=(std::uint32_t)crc64;
+#endif
+    for(; len>=4; len-=4, data+=4){
+        std::uint32_t word;
+        std::memcpy(&word, data, 4);
+        crc=_mm_crc32_u32(crc, word);
+    }
+    while(len--)
+        crc=_mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+/**
+ * Utility function for CRC32C checksums
+ * @param data - chunk of data to be checked
+ * @param len - length of the chunk
+ * @return CRC32C of the chunk
+ */
+std::uint32_t computeCRC32C(const char* data, std::size_t len) {
+#ifdef CRC32C_HW
+    static const bool hardware=(__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+    if(hardware)
+        return ~crc32cHardware(0xFFFFFFFF, (const unsigned char*)data, len);
+#endif
+    return ~crc32cTable(0xFFFFFFFF, (const unsigned char*)data, len);
+}
+
+/**
+ * Utility function for fast integrity checks of data chunks
+ * @param data - chunk of data to be checked
+ * @return std::string containing the hex representation of the CRC32C of the chunk
+ */
+std::string computeChecksum(const std::vector<char>& data) {
+    std::uint32_t crc=computeCRC32C(data.data(), data.size());
+    unsigned char bytes[CRC32C_LEN]={(unsigned char)(crc>>24), (unsigned char)(crc>>16), (unsigned char)(crc>>8), (unsigned char)crc};
+    return bytesToHex(bytes, CRC32C_LEN);
+}
+
+/**
+ * Utility function for the weak checksum of a block of a delta transfer (the rsync one):
+ * the sum of the bytes and the sum of the partial sums, both modulo 2^16
+ * @param data - block of data
+ * @param len - length of the block
+ * @return checksum of the block, the second sum in the upper 16 bits
+ */
+std::uint32_t computeRollingChecksum(const char* data, std::size_t len) {
+    std::uint32_t a=0, b=0;
+    for(std::size_t i=0; i<len; i++){
+        a+=(unsigned char)data[i];
+        b+=a;
+    }
+    return (a & 0xFFFF) | (b<<16);
+}
+
+/**
+ * Utility function for moving the weak checksum of a block one byte forward in O(1)
+ * @param sum - checksum of the block (see computeRollingChecksum)
+ * @param out - first byte of the block, leaving it
+ * @param in - byte following the block, entering it
+ * @param len - length of the block
+ * @return checksum of the block starting one byte later
+ */
+std::uint32_t rollChecksum(std::uint32_t sum, unsigned char out, unsigned char in, std::size_t len) {
+    std::uint32_t a=sum & 0xFFFF, b=sum>>16;
+    a=a-out+in;
+    b=b-std::uint32_t(len)*out+a;
+    return (a & 0xFFFF) | (b<<16);
+}
+
+/**
+ * Utility function for the strong checksum of a block of a delta transfer, checked only when the weak one matches
+ * @param data - block of data
+ * @param len - length of the block
+ * @return std::string containing the first BLOCK_DIGEST_LEN raw bytes of the BLAKE2b digest of the block
+ */
+std::string computeBlockDigest(const char* data, std::size_t len) {
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    if(EVP_Digest(data, len, md_value, &md_len, EVP_blake2b512(), nullptr)!=1 || md_len<BLOCK_DIGEST_LEN)
+        return "";
+    return std::string((const char*)md_value, BLOCK_DIGEST_LEN);
+}
+
+/*
+ * FastCDC: a gear hash (shift and add of a random value for every byte, so that the top bits depend
+ * on the last 64 bytes only) is computed over the data and a chunk ends where its top bits are zero.
+ * A stricter mask is used before the average length and a looser one after it (normalized chunking),
+ * so that the lengths stay close to the average.
+ */
+#define CDC_MASK_S (~std::uint64_t(0)<<(64-18))
+#define CDC_MASK_L (~std::uint64_t(0)<<(64-14))
+
+/**
+ * Utility function for content-defined chunking: the boundaries depend only on the content around them,
+ * so an insertion moves the following boundaries with the data and the chunks after it stay the same
+ * @param data - data starting with the chunk
+ * @param len - length of the data (at least CDC_MAX_SIZE, unless it is the end of the file)
+ * @return length of the chunk at the beginning of the data
+ */
+std::size_t findChunkBoundary(const char* data, std::size_t len) {
+    static const auto gear=[]{
+        std::vector<std::uint64_t> g(256);
+        std::uint64_t x=0x9E3779B97F4A7C15;
+        for(auto &v : g){
+            // splitmix64, the same table on client and server
+            std::uint64_t z=(x+=0x9E3779B97F4A7C15);
+            z=(z ^ (z>>30)) * 0xBF58476D1CE4E5B9;
+            z=(z ^ (z>>27)) * 0x94D049BB133111EB;
+            v=z ^ (z>>31);
+        }
+        return g;
+    }();
+
+    std::size_t n=std::min<std::size_t>(len, CDC_MAX_SIZE);
+    if(n<=CDC_MIN_SIZE)
+        return n;
+    std::size_t normal=std::min<std::size_t>(n, CDC_AVG_SIZE);
+    std::uint64_t fp=0;
+    std::size_t i=CDC_MIN_SIZE;
+    for(; i<normal; i++){
+        fp=(fp<<1) + gear[(unsigned char)data[i]];
+        if(!(fp & CDC_MASK_S))
+            return i+1;
+    }
+    for(; i<n; i++){
+        fp=(fp<<1) + gear[(unsigned char)data[i]];
+        if(!(fp & CDC_MASK_L))
+            return i+1;
+    }
+    return n;
+}
+
+/**
+ * Utility function for splitting a file in content-defined chunks (see findChunkBoundary), read sequentially
+ * @param path - path of the file
+ * @param chunk - function called for every chunk in order with its data and length, returning false to stop
+ * @return true on success, false on read errors or if stopped
+ */
+bool splitFile(const std::string& path, const std::function<bool(const char*, std::size_t)>& chunk) {
+    std::ifstream fs(path, std::ios::in | std::ios::binary);
+    if(fs.fail()) {
+        std::cout << strerror(errno) << std::endl;
+        return false;
+    }
 
-    return ss.str();
+    std::vector<char> buf(4*CDC_MAX_SIZE);
+    std::size_t pos=0, end=0;
+    bool eof=false;
+    while(true){
+        // Keep at least CDC_MAX_SIZE bytes after pos until the end of the file
+        if(!eof && end-pos<CDC_MAX_SIZE){
+            std::memmove(buf.data(), buf.data()+pos, end-pos);
+            end-=pos;
+            pos=0;
+            fs.read(buf.data()+end, buf.size()-end);
+            end+=fs.gcount();
+            eof=fs.eof();
+            if(fs.bad())
+                return false;
+        }
+        if(pos==end)
+            return true;
+        std::size_t len=findChunkBoundary(buf.data()+pos, end-pos);
+        if(!chunk(buf.data()+pos, len))
+            return false;
+        pos+=len;
+    }
 }
 
 std::string getActionString(int opcode) {
@@ -89,9 +288,114 @@ std::string getActionString(int opcode) {
         case 108: return "ping";
         case 109: return "check_dir";
         case 110: return "start_probe";
+        case 111: return "set_chunk";
+        case 112: return "check_batch";
+        case 113: return "check_tree";
+        case 114: return "have_content";
+        case 115: return "get_signature";
+        case 116: return "put_delta";
+        case 117: return "check_chunks";
+        case 118: return "put_chunks";
         case 199: return "eop";
         case 200: return "ok";
         case 400: return "error";
         default: return "null";
     }
 }
+
+/**
+ * Utility function for the Merkle tree hash of a directory, the same on client and server
+ * @param entries - (name, type and hash) of the entries of the directory: "f" followed by
+ * the SHA3-256 digest for files, "d" followed by the tree hash for directories (sorted by name)
+ * @return std::string containing the hex representation of the SHA3-256 digest of the sorted entries
+ */
+std::string computeTreeHash(std::vector<std::pair<std::string, std::string>>& entries) {
+    HashStream digest;
+
+    std::sort(entries.begin(), entries.end());
+    for(auto &e : entries){
+        digest.update(e.first.data(), e.first.size() + 1);
+        digest.update(e.second.data(), e.second.size() + 1);
+    }
+
+    return digest.final();
+}
+
+/**
+ * Utility function for hex encoding
+ * @param bytes - raw bytes to be encoded
+ * @param len - number of bytes
+ * @return std::string containing the lowercase hex representation of the bytes
+ */
+std::string bytesToHex(const unsigned char* bytes, std::size_t len) {
+    static const char digits[]="0123456789abcdef";
+    std::string hex(2*len, '0');
+    for(std::size_t i=0; i<len; i++){
+        hex[2*i]=digits[bytes[i]>>4];
+        hex[2*i+1]=digits[bytes[i] & 0x0F];
+    }
+    return hex;
+}
+
+/**
+ * Utility function for hex decoding
+ * @param hex - hex string to be decoded
+ * @param out - destination buffer
+ * @param maxLen - size of the destination buffer
+ * @param len - number of decoded bytes
+ * @return true on success, false if hex is not a valid hex string or doesn't fit in out
+ */
+bool hexToBytes(const std::string& hex, unsigned char* out, std::size_t maxLen, std::size_t& len) {
+    auto value=[](char c) -> int {
+        if(c>='0' && c<='9') return c-'0';
+        if(c>='a' && c<='f') return c-'a'+10;
+        if(c>='A' && c<='F') return c-'A'+10;
+        return -1;
+    };
+
+    len=hex.size()/2;
+    if(hex.size()%2 || len>maxLen)
+        return false;
+    for(std::size_t i=0; i<len; i++){
+        int hi=value(hex[2*i]), lo=value(hex[2*i+1]);
+        if(hi<0 || lo<0)
+            return false;
+        out[i]=(unsigned char)((hi<<4) | lo);
+    }
+    return true;
+}
+
+/**
+ * Constructor, starts a new SHA3-256 digest
+ */
+HashStream::HashStream() {
+    ctx=EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha3_256(), nullptr);
+}
+
+HashStream::~HashStream() {
+    EVP_MD_CTX_free(ctx);
+}
+
+/**
+ * Add a chunk of data to the digest
+ * @param data - chunk of data
+ * @param len - length of the chunk
+ */
+void HashStream::update(const char* data, std::size_t len) {
+    EVP_DigestUpdate(ctx, data, len);
+}
+
+/**
+ * @return std::string containing the hex representation of the digest of all the data added
+ * (empty string on errors), the digest is restarted afterwards
+ */
+std::string HashStream::final() {
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    bool done=EVP_DigestFinal_ex(ctx, md_value, &md_len)==1;
+    EVP_DigestInit_ex(ctx, EVP_sha3_256(), nullptr);
+
+    return done ? bytesToHex(md_value, md_len) : "";
+}
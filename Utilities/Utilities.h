@@ -2,7 +2,52 @@
 
 #include <iostream>
 #include <vector>
+#include <cstdint>
+#include <utility>
+#include <functional>
+#include <openssl/evp.h>
+
+// Length in bytes of a CRC32C checksum
+#define CRC32C_LEN 4
+
+// Length in bytes of the strong checksum of a block of a delta transfer (truncated BLAKE2b)
+#define BLOCK_DIGEST_LEN 16
+
+// Content-defined chunking (FastCDC): minimum, average and maximum length in bytes of the chunks
+#define CDC_MIN_SIZE (16*1024)
+#define CDC_AVG_SIZE (64*1024)
+#define CDC_MAX_SIZE (256*1024)
 
 std::string computeHash(const std::vector<char>& data);
 std::string computeFileHash(const std::string& path);
-std::string getActionString(int opcode);
\ No newline at end of file
+std::uint32_t computeCRC32C(const char* data, std::size_t len);
+std::string computeChecksum(const std::vector<char>& data);
+std::uint32_t computeRollingChecksum(const char* data, std::size_t len);
+std::uint32_t rollChecksum(std::uint32_t sum, unsigned char out, unsigned char in, std::size_t len);
+std::string computeBlockDigest(const char* data, std::size_t len);
+std::size_t findChunkBoundary(const char* data, std::size_t len);
+bool splitFile(const std::string& path, const std::function<bool(const char*, std::size_t)>& chunk);
+std::string computeTreeHash(std::vector<std::pair<std::string, std::string>>& entries);
+std::string getActionString(int opcode);
+std::string bytesToHex(const unsigned char* bytes, std::size_t len);
+bool hexToBytes(const std::string& hex, unsigned char* out, std::size_t maxLen, std::size_t& len);
+
+/**
+ * Streaming SHA3-256 digest of data received in more chunks
+ */
+class HashStream {
+    EVP_MD_CTX *ctx;
+
+public:
+    HashStream();
+
+    ~HashStream();
+
+    HashStream(const HashStream&) = delete;
+
+    HashStream& operator=(const HashStream&) = delete;
+
+    void update(const char* data, std::size_t len);
+
+    std::string final();
+};
\ No newline at end of file
@@ -29,6 +29,12 @@
 
    René Nyffenegger rene.nyffenegger@adp-gmbh.ch
 
+   Altered version: SSSE3/AVX2 encoding and decoding kernels (selected at
+   runtime) and decoding into a caller provided std::vector<char> added.
+   The kernels follow the algorithms described by Wojciech Muła and
+   Daniel Lemire in "Faster Base64 Encoding and Decoding using AVX2
+   Instructions" (https://arxiv.org/abs/1704.00605).
+
 */
 
 #include "base64.h"
@@ -36,6 +42,11 @@
 #include <algorithm>
 #include <stdexcept>
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BASE64_SIMD
+#include <immintrin.h>
+#endif
+
  //
  // Depending on the url parameter in base64_chars, one of
  // two sets of base64 characters needs to be chosen.
@@ -108,107 +119,352 @@ static std::string encode(String s, bool url) {
   return base64_encode(reinterpret_cast<const unsigned char*>(s.data()), s.length(), url);
 }
 
-std::string base64_encode(unsigned char const* bytes_to_encode, size_t in_len, bool url) {
-
-    size_t len_encoded = (in_len +2) / 3 * 4;
-
-    unsigned char trailing_char = url ? '.' : '=';
-
+static size_t encode_scalar(unsigned char const* bytes_to_encode, size_t in_len, char* out, const char* base64_chars_, char trailing_char) {
  //
- // Choose set of base64 characters. They differ
- // for the last two positions, depending on the url
- // parameter.
- // A bool (as is the parameter url) is guaranteed
- // to evaluate to either 0 or 1 in C++ therefore,
- // the correct character set is chosen by subscripting
- // base64_chars with url.
+ // Scalar encoding of in_len bytes, returns the number of characters written
  //
-    const char* base64_chars_ = base64_chars[url];
-
-    std::string ret;
-    ret.reserve(len_encoded);
-
-    unsigned int pos = 0;
+    size_t pos = 0;
+    char* ret = out;
 
     while (pos < in_len) {
-        ret.push_back(base64_chars_[(bytes_to_encode[pos + 0] & 0xfc) >> 2]);
+        *ret++ = base64_chars_[(bytes_to_encode[pos + 0] & 0xfc) >> 2];
 
         if (pos+1 < in_len) {
-           ret.push_back(base64_chars_[((bytes_to_encode[pos + 0] & 0x03) << 4) + ((bytes_to_encode[pos + 1] & 0xf0) >> 4)]);
+           *ret++ = base64_chars_[((bytes_to_encode[pos + 0] & 0x03) << 4) + ((bytes_to_encode[pos + 1] & 0xf0) >> 4)];
 
            if (pos+2 < in_len) {
-              ret.push_back(base64_chars_[((bytes_to_encode[pos + 1] & 0x0f) << 2) + ((bytes_to_encode[pos + 2] & 0xc0) >> 6)]);
-              ret.push_back(base64_chars_[  bytes_to_encode[pos + 2] & 0x3f]);
+              *ret++ = base64_chars_[((bytes_to_encode[pos + 1] & 0x0f) << 2) + ((bytes_to_encode[pos + 2] & 0xc0) >> 6)];
+              *ret++ = base64_chars_[  bytes_to_encode[pos + 2] & 0x3f];
            }
            else {
-              ret.push_back(base64_chars_[(bytes_to_encode[pos + 1] & 0x0f) << 2]);
-              ret.push_back(trailing_char);
+              *ret++ = base64_chars_[(bytes_to_encode[pos + 1] & 0x0f) << 2];
+              *ret++ = trailing_char;
            }
         }
         else {
 
-            ret.push_back(base64_chars_[(bytes_to_encode[pos + 0] & 0x03) << 4]);
-            ret.push_back(trailing_char);
-            ret.push_back(trailing_char);
+            *ret++ = base64_chars_[(bytes_to_encode[pos + 0] & 0x03) << 4];
+            *ret++ = trailing_char;
+            *ret++ = trailing_char;
         }
 
         pos += 3;
     }
 
+    return ret - out;
+}
 
-    return ret;
+#ifdef BASE64_SIMD
+ //
+ // SIMD kernels. They only handle the standard (non url) alphabet and
+ // whole blocks: every kernel returns the number of input characters/bytes
+ // it consumed and leaves the tail (padding included) to the scalar code.
+ //
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_translate_ssse3(__m128i indices) {
+ //
+ // 6-bit indices to ASCII: the offset to be added is looked up by range
+ // (0..25, 26..51, 52..61, 62, 63)
+ //
+    const __m128i shift_lut = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, result), indices);
 }
 
-template <typename String>
-static std::string decode(String encoded_string, bool remove_linebreaks) {
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(unsigned char const* in, size_t in_len, char* out) {
  //
- // decode(…) is templated so that it can be used with String = const std::string&
- // or std::string_view (requires at least C++17)
+ // 12 bytes -> 16 characters per iteration (16 bytes are loaded)
  //
+    const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    size_t pos = 0;
 
-    if (encoded_string.empty()) return std::string();
+    while (in_len - pos >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos));
+        v = _mm_shuffle_epi8(v, shuffle);
+        const __m128i t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+        const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        const __m128i t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+        const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), enc_translate_ssse3(_mm_or_si128(t1, t3)));
+        pos += 12;
+        out += 16;
+    }
 
-    if (remove_linebreaks) {
+    return pos;
+}
 
-       std::string copy(encoded_string);
+__attribute__((target("avx2")))
+static size_t encode_avx2(unsigned char const* in, size_t in_len, char* out) {
+ //
+ // 24 bytes -> 32 characters per iteration (28 bytes are loaded)
+ //
+    const __m256i shuffle = _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift_lut = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    size_t pos = 0;
 
-       copy.erase(std::remove(copy.begin(), copy.end(), '\n'), copy.end());
+    while (in_len - pos >= 28) {
+        const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos));
+        const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        v = _mm256_shuffle_epi8(v, shuffle);
+        const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+        __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, result), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), result);
+        pos += 24;
+        out += 32;
+    }
 
-       return base64_decode(copy, false);
+    return pos + encode_ssse3(in + pos, in_len - pos, out);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i dec_reshuffle_ssse3(__m128i in) {
+ //
+ // Packs the 6-bit values of every 4 characters into 3 bytes (12 valid bytes)
+ //
+    const __m128i merge_ab_and_bc = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    const __m128i merged = _mm_madd_epi16(merge_ab_and_bc, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(merged, _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3(unsigned char const* in, size_t in_len, char* out) {
+ //
+ // 16 characters -> 12 bytes per iteration (16 bytes are stored, so at least
+ // 8 more characters must follow the block). Stops at the first block
+ // containing a character outside the standard alphabet.
+ //
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    size_t pos = 0;
+
+    while (in_len - pos >= 24) {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos));
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())))
+            break;
+        const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        str = dec_reshuffle_ssse3(_mm_add_epi8(str, roll));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), str);
+        pos += 16;
+        out += 12;
     }
 
-    size_t length_of_string = encoded_string.length();
+    return pos;
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(unsigned char const* in, size_t in_len, char* out) {
+ //
+ // 32 characters -> 24 bytes per iteration (32 bytes are stored, so at least
+ // 16 more characters must follow the block)
+ //
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
     size_t pos = 0;
 
+    while (in_len - pos >= 48) {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + pos));
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+        const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+        const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        str = _mm256_add_epi8(str, roll);
+        const __m256i merge_ab_and_bc = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        str = _mm256_madd_epi16(merge_ab_and_bc, _mm256_set1_epi32(0x00011000));
+        str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), str);
+        pos += 32;
+        out += 24;
+    }
+
+    return pos + decode_ssse3(in + pos, in_len - pos, out);
+}
+#endif  // BASE64_SIMD
+
+typedef size_t (*base64_kernel)(unsigned char const*, size_t, char*);
+
+static base64_kernel select_kernel(bool decoding) {
+ //
+ // Runtime CPU dispatch, done once per process by the callers
+ //
+#ifdef BASE64_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return decoding ? decode_avx2 : encode_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return decoding ? decode_ssse3 : encode_ssse3;
+#endif
+    return nullptr;
+}
+
+static void encode_to(unsigned char const* bytes_to_encode, size_t in_len, char* out, bool url) {
  //
- // The approximate length (bytes) of the decoded string might be one or
- // two bytes smaller, depending on the amount of trailing equal signs
- // in the encoded string. This approximation is needed to reserve
- // enough space in the string to be returned.
+ // out must have room for (in_len + 2) / 3 * 4 characters
  //
-    size_t approx_length_of_decoded_string = length_of_string / 4 * 3;
-    std::string ret;
-    ret.reserve(approx_length_of_decoded_string);
+    static const base64_kernel kernel = select_kernel(false);
+
+    char trailing_char = url ? '.' : '=';
+
+ //
+ // Choose set of base64 characters. They differ
+ // for the last two positions, depending on the url
+ // parameter.
+ // A bool (as is the parameter url) is guaranteed
+ // to evaluate to either 0 or 1 in C++ therefore,
+ // the correct character set is chosen by subscripting
+ // base64_chars with url.
+ //
+    const char* base64_chars_ = base64_chars[url];
+
+    size_t pos = 0;
+    if (kernel && !url)
+        pos = kernel(bytes_to_encode, in_len, out);
+
+    encode_scalar(bytes_to_encode + pos, in_len - pos, out + pos / 3 * 4, base64_chars_, trailing_char);
+}
+
+std::string base64_encode(unsigned char const* bytes_to_encode, size_t in_len, bool url) {
+
+    size_t len_encoded = (in_len +2) / 3 * 4;
+
+    std::string ret(len_encoded, '\0');
+    encode_to(bytes_to_encode, in_len, &ret[0], url);
+
+    return ret;
+}
+
+void base64_encode(unsigned char const* bytes_to_encode, size_t in_len, std::string& out) {
+
+    size_t offset = out.size();
+
+    out.resize(offset + (in_len + 2) / 3 * 4);
+    encode_to(bytes_to_encode, in_len, &out[offset], false);
+}
+
+static size_t decode_scalar(unsigned char const* encoded_string, size_t length_of_string, char* out) {
+ //
+ // Scalar decoding, returns the number of bytes written. The last group
+ // may lack its padding (2 or 3 characters), it is decoded as if padded
+ //
+    size_t pos = 0;
+    char* ret = out;
 
     while (pos < length_of_string) {
 
+       if (pos + 1 >= length_of_string)
+          throw std::runtime_error("Input is not valid base64-encoded data.");
+
        unsigned int pos_of_char_1 = pos_of_char(encoded_string[pos+1] );
 
-       ret.push_back(static_cast<std::string::value_type>( ( (pos_of_char(encoded_string[pos+0]) ) << 2 ) + ( (pos_of_char_1 & 0x30 ) >> 4)));
+       *ret++ = static_cast<char>( ( (pos_of_char(encoded_string[pos+0]) ) << 2 ) + ( (pos_of_char_1 & 0x30 ) >> 4));
 
-       if (encoded_string[pos+2] != '=' && encoded_string[pos+2] != '.') { // accept URL-safe base 64 strings, too, so check for '.' also.
+       if (pos + 2 < length_of_string && encoded_string[pos+2] != '=' && encoded_string[pos+2] != '.') { // accept URL-safe base 64 strings, too, so check for '.' also.
 
           unsigned int pos_of_char_2 = pos_of_char(encoded_string[pos+2] );
-          ret.push_back(static_cast<std::string::value_type>( (( pos_of_char_1 & 0x0f) << 4) + (( pos_of_char_2 & 0x3c) >> 2)));
+          *ret++ = static_cast<char>( (( pos_of_char_1 & 0x0f) << 4) + (( pos_of_char_2 & 0x3c) >> 2));
 
-          if (encoded_string[pos+3] != '=' && encoded_string[pos+3] != '.') {
-             ret.push_back(static_cast<std::string::value_type>( ( (pos_of_char_2 & 0x03 ) << 6 ) + pos_of_char(encoded_string[pos+3])   ));
+          if (pos + 3 < length_of_string && encoded_string[pos+3] != '=' && encoded_string[pos+3] != '.') {
+             *ret++ = static_cast<char>( ( (pos_of_char_2 & 0x03 ) << 6 ) + pos_of_char(encoded_string[pos+3])   );
           }
        }
 
        pos += 4;
     }
 
+    return ret - out;
+}
+
+static size_t decode_to(unsigned char const* encoded_string, size_t length_of_string, char* out) {
+ //
+ // out must have room for (length_of_string + 3) / 4 * 3 bytes
+ //
+    static const base64_kernel kernel = select_kernel(true);
+
+    size_t pos = 0;
+    if (kernel)
+        pos = kernel(encoded_string, length_of_string, out);
+
+    return pos / 4 * 3 + decode_scalar(encoded_string + pos, length_of_string - pos, out + pos / 4 * 3);
+}
+
+template <typename String>
+static std::string decode(String encoded_string, bool remove_linebreaks) {
+ //
+ // decode(…) is templated so that it can be used with String = const std::string&
+ // or std::string_view (requires at least C++17)
+ //
+
+    if (encoded_string.empty()) return std::string();
+
+    if (remove_linebreaks) {
+
+       std::string copy(encoded_string);
+
+       copy.erase(std::remove(copy.begin(), copy.end(), '\n'), copy.end());
+
+       return base64_decode(copy, false);
+    }
+
+    std::string ret((encoded_string.length() + 3) / 4 * 3, '\0');
+    ret.resize(decode_to(reinterpret_cast<unsigned char const*>(encoded_string.data()), encoded_string.length(), &ret[0]));
+
     return ret;
 }
 
@@ -251,4 +507,10 @@ std::string base64_decode(std::string_view s, bool remove_linebreaks) {
    return decode(s, remove_linebreaks);
 }
 
+void base64_decode(std::string_view s, std::vector<char>& out) {
+   out.resize((s.length() + 3) / 4 * 3);
+   if (!s.empty())
+      out.resize(decode_to(reinterpret_cast<unsigned char const*>(s.data()), s.length(), out.data()));
+}
+
 #endif  // __cplusplus >= 201703L
@@ -7,6 +7,7 @@
 #define BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A
 
 #include <string>
+#include <vector>
 
 #if __cplusplus >= 201703L
 #include <string_view>
@@ -19,6 +20,11 @@ std::string base64_encode_mime(std::string const& s);
 std::string base64_decode(std::string const& s, bool remove_linebreaks = false);
 std::string base64_encode(unsigned char const*, size_t len, bool url = false);
 
+//
+// Appends the encoding of the bytes to out
+//
+void base64_encode(unsigned char const*, size_t len, std::string& out);
+
 #if __cplusplus >= 201703L
 //
 // Interface with std::string_view rather than const std::string&
@@ -30,6 +36,11 @@ std::string base64_encode_pem (std::string_view s);
 std::string base64_encode_mime(std::string_view s);
 
 std::string base64_decode(std::string_view s, bool remove_linebreaks = false);
+
+//
+// Decodes s straight into out (resized to the decoded length)
+//
+void base64_decode(std::string_view s, std::vector<char>& out);
 #endif  // __cplusplus >= 201703L
 
 #endif /* BASE64_H_C0CE2A47_D10E_42C9_A27C_C883944E704A */